@@ -0,0 +1,270 @@
+/*
+ * Serial link benchmark.
+ *
+ * For every baud rate open_serial_port() supports, starts the controller
+ * emulator pacing its answers at that rate, opens the pty through
+ * open_serial_port() and measures
+ *
+ *  - round trip time of each poll command through request_port_timeout(),
+ *    reported as percentiles,
+ *  - poll cycles (every command of the table) per second through the
+ *    serial_queue the poller uses, with as many commands in flight as the
+ *    poller's -P (default SDK_PIPELINE_DEPTH),
+ *  - CPU time spent per received frame during the pipelined run.
+ *
+ * The commands are the daemon's poll set, loaded by sdk_table_load(): the
+ * built-in table, or the one given with -c like the daemon's -c.
+ *
+ * Run as "make bench-serial" or ./bench_serial [-e emulator] [-t seconds]
+ * [-l latency_ms] [-r baud[,baud...]] [-P depth] [-c commands].
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "serial.h"
+#include "sdk_table.h"
+
+#define BENCH_MAX_SAMPLES	4096
+#define BENCH_ANSWER_MAX	64
+
+static const long m_rates[] = {
+	300, 600, 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600, 115200
+};
+
+static char *m_emulator = "./sdk_emu";
+static double m_seconds = 2.0;
+static char *m_latency = "1";
+static int m_depth = SDK_PIPELINE_DEPTH;
+static char *m_commands = NULL;
+
+static unsigned long m_frames;
+static unsigned long m_timeouts;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_sec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+	int i = (int)(p * (n - 1) + 0.5);
+
+	return sorted[i < n ? i : n - 1];
+}
+
+static pid_t start_emulator(long baud, char *device, size_t size)
+{
+	char rate[16];
+	int fds[2];
+	FILE *fp;
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		return -1;
+	}
+	snprintf(rate, sizeof (rate), "%ld", baud);
+	pid = fork();
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(m_emulator, m_emulator, "-b", rate, "-l", m_latency, (char *)NULL);
+		perror(m_emulator);
+		_exit(1);
+	}
+	close(fds[1]);
+	fp = fdopen(fds[0], "r");
+	if (pid < 0 || fp == NULL || fgets(device, size, fp) == NULL) {
+		if (pid > 0) {
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+		}
+		return -1;
+	}
+	device[strcspn(device, "\n")] = '\0';
+	fclose(fp);
+	return pid;
+}
+
+static void count_answer(void *arg, int tag, const char *frame, int len)
+{
+	if (len > 0) {
+		m_frames++;
+	} else {
+		m_timeouts++;
+	}
+}
+
+static void bench_rate(long baud)
+{
+	static double samples[SDK_MAX_COMMANDS][BENCH_MAX_SAMPLES];
+	struct sdk_command_def *cmd;
+	struct serial_queue queue;
+	char device[128];
+	char answer[SERIAL_FRAME_SIZE];
+	double t0, t1, c0, c1, start;
+	unsigned long cycles;
+	int count[SDK_MAX_COMMANDS];
+	int deadline, len, fd, i;
+	pid_t pid;
+
+	pid = start_emulator(baud, device, sizeof (device));
+	if (pid < 0) {
+		fprintf(stderr, "bench_serial: could not start %s\n", m_emulator);
+		exit(1);
+	}
+	fd = open_serial_port(device, baud, 8, 1, 0);
+	if (fd <= 0) {
+		fprintf(stderr, "bench_serial: could not open %s\n", device);
+		kill(pid, SIGTERM);
+		exit(1);
+	}
+	deadline = serial_deadline_ms(baud, 2 * BENCH_ANSWER_MAX * m_depth);
+
+	/* Round trips, one command at a time */
+	memset(count, 0, sizeof (count));
+	start = now_sec();
+	do {
+		for (i = 0; i < sdk_table.nr_commands; i++) {
+			if (count[i] >= BENCH_MAX_SAMPLES) {
+				continue;
+			}
+			cmd = &sdk_table.command[i];
+			t0 = now_sec();
+			len = request_port_timeout(cmd->message, cmd->len + 1, answer, fd, deadline);
+			t1 = now_sec();
+			if (len > 0) {
+				samples[i][count[i]++] = (t1 - t0) * 1000.0;
+			}
+		}
+	} while (now_sec() - start < m_seconds / 2 || count[0] < 3);
+
+	for (i = 0; i < sdk_table.nr_commands; i++) {
+		if (count[i] == 0) {
+			printf("%7ld  %-10s  %6d  %8s  %8s  %8s  %8s\n", baud,
+				sdk_table.command[i].name, 0, "-", "-", "-", "-");
+			continue;
+		}
+		qsort(samples[i], count[i], sizeof (double), cmp_double);
+		printf("%7ld  %-10s  %6d  %8.2f  %8.2f  %8.2f  %8.2f\n", baud,
+			sdk_table.command[i].name, count[i],
+			percentile(samples[i], count[i], 0.50),
+			percentile(samples[i], count[i], 0.90),
+			percentile(samples[i], count[i], 0.99),
+			samples[i][count[i] - 1]);
+	}
+
+	/* Poll cycles through the queue, m_depth commands in flight */
+	serial_queue_init(&queue, fd, m_depth, count_answer, NULL);
+	m_frames = 0;
+	m_timeouts = 0;
+	cycles = 0;
+	c0 = cpu_sec();
+	start = now_sec();
+	do {
+		for (i = 0; i < sdk_table.nr_commands; i++) {
+			serial_queue_push(&queue, sdk_table.command[i].message,
+				sdk_table.command[i].len, i, deadline);
+		}
+		if (serial_queue_flush(&queue) < 0) {
+			break;
+		}
+		cycles++;
+	} while (now_sec() - start < m_seconds / 2 || cycles < 2);
+	t1 = now_sec() - start;
+	c1 = cpu_sec() - c0;
+
+	printf("%7ld  depth %-4d  %6lu  cycles/s %8.2f  frames/s %8.2f  cpu/frame %7.1f us  timeouts %lu\n",
+		baud, m_depth, cycles, cycles / t1, m_frames / t1,
+		m_frames ? c1 * 1e6 / m_frames : 0.0, m_timeouts);
+	fflush(stdout);
+
+	close(fd);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+static void print_help(void)
+{
+	fprintf(stderr, "usage: bench_serial [-e emulator] [-t seconds] [-l latency_ms] [-r baud[,baud...]] [-P depth] [-c commands]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long rates[sizeof (m_rates) / sizeof (m_rates[0])];
+	int nr_rates = sizeof (m_rates) / sizeof (m_rates[0]);
+	char *ptr;
+	int c, i;
+
+	memcpy(rates, m_rates, sizeof (m_rates));
+	while ((c = getopt(argc, argv, "e:t:l:r:P:c:h")) != -1) {
+		switch (c) {
+		case 'e':
+			m_emulator = optarg;
+			break;
+		case 't':
+			m_seconds = atof(optarg);
+			break;
+		case 'l':
+			m_latency = optarg;
+			break;
+		case 'P':
+			m_depth = atoi(optarg);
+			if (m_depth < 1 || m_depth > SERIAL_QUEUE_SIZE) {
+				print_help();
+				exit(1);
+			}
+			break;
+		case 'c':
+			m_commands = optarg;
+			break;
+		case 'r':
+			nr_rates = 0;
+			for (ptr = strtok(optarg, ","); ptr != NULL && nr_rates < sizeof (rates) / sizeof (rates[0]);
+					ptr = strtok(NULL, ",")) {
+				rates[nr_rates++] = atol(ptr);
+			}
+			break;
+		default:
+			print_help();
+			exit(1);
+		}
+	}
+
+	if (sdk_table_load(m_commands) < 0) {
+		exit(1);
+	}
+	printf("   baud  command        n    p50 ms    p90 ms    p99 ms    max ms\n");
+	for (i = 0; i < nr_rates; i++) {
+		bench_rate(rates[i]);
+	}
+	return 0;
+}
@@ -24,6 +24,7 @@
 #include <time.h>
 
 #include "mini_snmpd.h"
+#include "sdk_state.h"
 
 
 
@@ -426,6 +427,64 @@ static int mib_update_entry(const oid_t *prefix, int column, int row,
 
 
 
+/* SDK entries (INTEGER, or COUNTER): position in g_mib, type and last encoded value */
+#define MIB_SDK_ENTRIES 49
+
+static int m_sdk_pos[MIB_SDK_ENTRIES];
+static int m_sdk_type[MIB_SDK_ENTRIES];
+static unsigned int m_sdk_value[MIB_SDK_ENTRIES];
+static int m_sdk_length = 0;
+static unsigned long m_sdk_generation = 0;
+
+static int mib_build_sdk_entry(int column, int row, int counter)
+{
+	int type = counter ? BER_TYPE_COUNTER : BER_TYPE_INTEGER;
+
+	if (m_sdk_length >= MIB_SDK_ENTRIES) {
+		return -1;
+	}
+	/* built with the cached value, zero until the first update */
+	if (mib_build_entry(&m_sdk_oid, column, row, type,
+		(const void *)(long)m_sdk_value[m_sdk_length]) == -1) {
+		return -1;
+	}
+	/* entries never move once built, so updates can skip the OID search */
+	m_sdk_pos[m_sdk_length] = g_mib_length - 1;
+	m_sdk_type[m_sdk_length] = type;
+	m_sdk_length++;
+	return 0;
+}
+
+static void mib_sdk_values(const sdkinfo_t *sdkinfo, unsigned int *values)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 20; i++) {
+		values[n++] = sdkinfo->dry_contact[i];
+	}
+	values[n++] = sdkinfo->sdk_temp;
+	values[n++] = sdkinfo->sdk_hw;
+	values[n++] = sdkinfo->sdk_sw;
+	values[n++] = sdkinfo->sdk_relay;
+	for (i = 0; i < 4; i++) {
+		values[n++] = sdkinfo->optical_relay[i];
+	}
+	for (i = 0; i < 20; i++) {
+		values[n++] = sdkinfo->edge_count[i];
+	}
+	values[n++] = sdkinfo->stale;
+}
+
+static int mib_encode_value(value_t *value, int type, unsigned int new_value)
+{
+	if (type == BER_TYPE_INTEGER) {
+		return encode_snmp_element_integer(value, (int)new_value);
+	}
+	return encode_snmp_element_unsigned(value, type, new_value);
+}
+
+
+
 /* -----------------------------------------------------------------------------
  * Interface functions
  *
@@ -453,6 +512,7 @@ static int mib_update_entry(const oid_t *prefix, int column, int row,
 
 int mib_build(void)
 {
+	int i;
 
 	
 
@@ -467,40 +527,33 @@ int mib_build(void)
 
 
 
-	if (mib_build_entry(&m_sdk_oid, 1, 0, BER_TYPE_INTEGER, (const void *)0) == -1	
-            || mib_build_entry(&m_sdk_oid, 1, 1, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 2, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 3, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 4, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 5, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 6, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 7, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 8, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 9, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 10, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 11, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 12, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 13, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 14, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 15, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 16, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 17, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 18, BER_TYPE_INTEGER, (const void *)0) == -1
-            || mib_build_entry(&m_sdk_oid, 1, 19, BER_TYPE_INTEGER, (const void *)0) == -1 
-	    || mib_build_entry(&m_sdk_oid, 2, 0, BER_TYPE_INTEGER, (const void *)0) == -1
-	    || mib_build_entry(&m_sdk_oid, 3, 0, BER_TYPE_INTEGER, (const void *)0) == -1
-	    || mib_build_entry(&m_sdk_oid, 4, 0, BER_TYPE_INTEGER, (const void *)0) == -1
-	    || mib_build_entry(&m_sdk_oid, 5, 0, BER_TYPE_INTEGER, (const void *)0) == -1
-	    || mib_build_entry(&m_sdk_oid, 6, 0, BER_TYPE_INTEGER, (const void *)0) == -1
-	    || mib_build_entry(&m_sdk_oid, 6, 1, BER_TYPE_INTEGER, (const void *)0) == -1
-	    || mib_build_entry(&m_sdk_oid, 6, 2, BER_TYPE_INTEGER, (const void *)0) == -1 
-	    || mib_build_entry(&m_sdk_oid, 6, 3, BER_TYPE_INTEGER, (const void *)0) == -1) {
+	/* SDK subtree, in the order mib_sdk_values() lists the values */
+	for (i = 0; i < 20; i++) {
+		if (mib_build_sdk_entry(1, i, 0) == -1) {
+			return -1;
+		}
+	}
+	if (mib_build_sdk_entry(2, 0, 0) == -1
+		|| mib_build_sdk_entry(3, 0, 0) == -1
+		|| mib_build_sdk_entry(4, 0, 0) == -1
+		|| mib_build_sdk_entry(5, 0, 0) == -1) {
+		return -1;
+	}
+	for (i = 0; i < 4; i++) {
+		if (mib_build_sdk_entry(6, i, 0) == -1) {
+			return -1;
+		}
+	}
+	/* dry contact edges recorded so far, one row per contact */
+	for (i = 0; i < 20; i++) {
+		if (mib_build_sdk_entry(7, i, 1) == -1) {
+			return -1;
+		}
+	}
+	/* 1 while the values are the last known ones from before a restart */
+	if (mib_build_sdk_entry(8, 0, 0) == -1) {
 		return -1;
 	}
-
-
-
-
 
 	return 0;
 }
@@ -517,8 +570,8 @@ int mib_update(int full)
 		demoinfo_t demoinfo;
 #endif
 	} u;
-
-	int pos;
+	unsigned int values[MIB_SDK_ENTRIES];
+	int pos, i;
 
 
 	/* Begin searching at the first MIB entry */
@@ -536,41 +589,21 @@ int mib_update(int full)
 #endif
 
 
-	if (full) {
+	/* The SDK values only change with a new published state */
+	if (sdk_state_generation(0) != m_sdk_generation) {
 		get_sdkinfo(&u.sdkinfo);
-		if (       mib_update_entry(&m_sdk_oid, 1, 0, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_1) == -1
-			|| mib_update_entry(&m_sdk_oid, 1, 1, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_2) == -1
-			|| mib_update_entry(&m_sdk_oid, 1, 2, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_3) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 3, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_4) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 4, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_5) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 5, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_6) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 6, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_7) == -1   
-                        || mib_update_entry(&m_sdk_oid, 1, 7, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_8) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 8, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_9) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 9, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_10) == -1   
-                        || mib_update_entry(&m_sdk_oid, 1, 10, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_11) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 11, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_12) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 12, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_13) == -1   
-                        || mib_update_entry(&m_sdk_oid, 1, 13, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_14) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 14, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_15) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 15, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_16) == -1   
-                        || mib_update_entry(&m_sdk_oid, 1, 16, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_17) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 17, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_18) == -1
-                        || mib_update_entry(&m_sdk_oid, 1, 18, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_19) == -1   
-                        || mib_update_entry(&m_sdk_oid, 1, 19, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.dry_contact_20) == -1
-			|| mib_update_entry(&m_sdk_oid, 2, 0, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.sdk_temp) == -1
-			|| mib_update_entry(&m_sdk_oid, 3, 0, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.sdk_hw) == -1
-			|| mib_update_entry(&m_sdk_oid, 4, 0, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.sdk_sw) == -1
-			|| mib_update_entry(&m_sdk_oid, 5, 0, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.sdk_relay) == -1
-			|| mib_update_entry(&m_sdk_oid, 6, 0, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.optical_relay_1) == -1
-			|| mib_update_entry(&m_sdk_oid, 6, 1, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.optical_relay_2) == -1
-			|| mib_update_entry(&m_sdk_oid, 6, 2, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.optical_relay_3) == -1
-			|| mib_update_entry(&m_sdk_oid, 6, 3, &pos, BER_TYPE_INTEGER, (const void *)u.sdkinfo.optical_relay_4) == -1) {
-			return -1;
+		mib_sdk_values(&u.sdkinfo, values);
+		for (i = 0; i < m_sdk_length; i++) {
+			if (values[i] != m_sdk_value[i]) {
+				if (mib_encode_value(&g_mib[m_sdk_pos[i]], m_sdk_type[i], values[i]) == -1) {
+					return -1;
+				}
+				m_sdk_value[i] = values[i];
+			}
 		}
+		m_sdk_generation = u.sdkinfo.generation;
 	}
 
-
 	return 0;
 }
 
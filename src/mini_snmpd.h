@@ -249,34 +249,15 @@ typedef struct demoinfo_s {
 
 
 typedef struct sdkinfo_s {
-	int dry_contact_1;
-	int dry_contact_2;
-        int dry_contact_3;
-        unsigned int dry_contact_4;
-        unsigned int dry_contact_5;
-        unsigned int dry_contact_6;
-        unsigned int dry_contact_7;
-        unsigned int dry_contact_8;
-        unsigned int dry_contact_9;
-        unsigned int dry_contact_10;
-        unsigned int dry_contact_11;
-        unsigned int dry_contact_12;
-        unsigned int dry_contact_13;
-        unsigned int dry_contact_14;
-        unsigned int dry_contact_15;
-        unsigned int dry_contact_16;
-        unsigned int dry_contact_17;
-        unsigned int dry_contact_18;
-        unsigned int dry_contact_19;
-        unsigned int dry_contact_20;
+	unsigned long generation;
+	unsigned int dry_contact[20];
 	unsigned int sdk_temp;
-        unsigned int sdk_hw;
-        unsigned int sdk_sw;
-        unsigned int sdk_relay;
-	unsigned int optical_relay_1;
-	unsigned int optical_relay_2;
-	unsigned int optical_relay_3;
-	unsigned int optical_relay_4;
+	unsigned int sdk_hw;
+	unsigned int sdk_sw;
+	unsigned int sdk_relay;
+	unsigned int optical_relay[4];
+	unsigned int edge_count[20];
+	unsigned int stale;
 } sdkinfo_t;
 
 
@@ -9,119 +9,687 @@
 #include <termios.h> /* POSIX terminal control definitions */
 #include <stdint.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 
 #include "parser_sdk.h"
 #include "serial.h"
+#include "sdk_sched.h"
+#include "sdk_table.h"
+#include "sdk_state.h"
+#include "sdk_persist.h"
 #include "log.h"
 
 #define DEBUG 1
+/* how long a failed serial port rests before it is opened again */
+#define SDK_REOPEN_MS 5000
+/* longest answer of the poll set, the 60-byte status frame */
+#define SDK_ANSWER_MAX 64
+/* failed status polls in a row after which a controller counts as offline */
+#define SDK_OFFLINE_FAILURES 3
+/* failed status polls in a row after which an auto-baud port is probed again */
+#define SDK_REPROBE_FAILURES 10
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Character classes for the decoder: bit 4 marks a valid character, the low
+ * nibble carries its value. ANDing the entries of a field keeps bit 4 only if
+ * every character was valid, so validation costs no extra branches.
+ */
+#define HEX_DIGIT(c, v) [c] = 0x10 | (v)
+
+static const unsigned char m_hex[256] = {
+        HEX_DIGIT('0', 0x0), HEX_DIGIT('1', 0x1), HEX_DIGIT('2', 0x2),
+        HEX_DIGIT('3', 0x3), HEX_DIGIT('4', 0x4), HEX_DIGIT('5', 0x5),
+        HEX_DIGIT('6', 0x6), HEX_DIGIT('7', 0x7), HEX_DIGIT('8', 0x8),
+        HEX_DIGIT('9', 0x9), HEX_DIGIT('A', 0xA), HEX_DIGIT('B', 0xB),
+        HEX_DIGIT('C', 0xC), HEX_DIGIT('D', 0xD), HEX_DIGIT('E', 0xE),
+        HEX_DIGIT('F', 0xF), HEX_DIGIT('a', 0xA), HEX_DIGIT('b', 0xB),
+        HEX_DIGIT('c', 0xC), HEX_DIGIT('d', 0xD), HEX_DIGIT('e', 0xE),
+        HEX_DIGIT('f', 0xF),
+};
+
+static const unsigned char m_dec[256] = {
+        HEX_DIGIT('0', 0x0), HEX_DIGIT('1', 0x1), HEX_DIGIT('2', 0x2),
+        HEX_DIGIT('3', 0x3), HEX_DIGIT('4', 0x4), HEX_DIGIT('5', 0x5),
+        HEX_DIGIT('6', 0x6), HEX_DIGIT('7', 0x7), HEX_DIGIT('8', 0x8),
+        HEX_DIGIT('9', 0x9),
+};
+
+static const unsigned char m_bin[256] = {
+        HEX_DIGIT('0', 0x0), HEX_DIGIT('1', 0x1),
+};
 
-long int ascii_to_int(char *);
 void * threading_sdk_serial(void * arg);
 
-long int ascii_to_int(char *data) {
 
-        char *ptr;
-        long ret;
-        ret = strtol(data, &ptr, 16);
-        return (ret);
+
+char *sdk_device_list[MAX_NR_SDK];
+int sdk_device_list_length = 0;
+long sdk_baud_rate = 57600;
+int sdk_baud_probe = 0;
+int sdk_pipeline_depth = SDK_PIPELINE_DEPTH;
+
+/* rates tried by the auto-baud probe, fastest first */
+static const long m_probe_rates[] = {
+        230400, 115200, 57600, 38400, 19200, 9600
+};
+
+#define SDK_NR_PROBE_RATES (sizeof(m_probe_rates) / sizeof(m_probe_rates[0]))
+
+struct sdk_port {
+        char *device;
+        int index;
+        int fd;
+        long baud;
+        int probe;                      /* rate being probed, -1 while polling */
+        int probe_attempt;
+        int reprobe;
+        unsigned long invalid;          /* answers rejected since the last state change */
+        long next_poll;
+        struct sdk_state state;         /* published after every change */
+        unsigned int answered;          /* commands answered since start-up, by tag */
+        struct sdk_status status;       /* every field as last decoded */
+        struct timespec sent[SDK_MAX_COMMANDS]; /* command of the last valid answer written */
+        struct serial_queue queue;
+        struct sched sched;
+};
+
+static struct sdk_port m_ports[MAX_NR_SDK];
+
+struct sdk_listener_entry {
+        sdk_listener callback;
+        void *arg;
+};
+
+static struct sdk_listener_entry m_listeners[SDK_MAX_LISTENERS];
+static int m_nr_listeners = 0;
+
+/* bits of a '0'/'1' field, up to 32 of them, -1 if a character is neither */
+static int sdk_decode_bits(const unsigned char *p, int width, uint32_t *value) {
+
+        uint32_t bits = 0;
+        unsigned char valid = 0x10;
+        int i = 0;
+
+#ifdef __SSE2__
+        if (width >= 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) p);
+                __m128i zero = _mm_set1_epi8('0');
+                __m128i one = _mm_set1_epi8('1');
+                __m128i is_one = _mm_cmpeq_epi8(v, one);
+                __m128i is_bit = _mm_or_si128(is_one, _mm_cmpeq_epi8(v, zero));
+
+                if (_mm_movemask_epi8(is_bit) != 0xFFFF) {
+                        return (-1);
+                }
+                bits = _mm_movemask_epi8(is_one);
+                i = 16;
+        }
+#endif
+        for (; i < width; i++) {
+                valid &= m_bin[p[i]];
+                bits |= (uint32_t)(m_bin[p[i]] & 1) << i;
+        }
+        *value = bits;
+        return (valid & 0x10) ? 0 : -1;
 }
 
+static int sdk_decode_field(const unsigned char *p, const struct sdk_field_def *f,
+                uint32_t *value) {
 
+        unsigned char valid = 0x10, c;
+        uint32_t v = 0;
+        int i;
 
-void * threading_sdk_serial(void * arg) {
-        struct sdk_param *sdk_serial = (struct sdk_param *) arg;
+        switch (f->decode) {
+        case SDK_DECODE_BITS:
+                return sdk_decode_bits(p, f->width, value);
+        case SDK_DECODE_DEC:
+                for (i = 0; i < f->width; i++) {
+                        c = m_dec[p[i]];
+                        valid &= c;
+                        v = v * 10 + (c & 0x0F);
+                }
+                break;
+        default:
+                for (i = 0; i < f->width; i++) {
+                        c = m_hex[p[i]];
+                        valid &= c;
+                        v = v << 4 | (c & 0x0F);
+                }
+                break;
+        }
+        *value = v;
+        return (valid & 0x10) ? 0 : -1;
+}
 
-        int len_answer_sdk = -1;
-        int fd, i;
+static void sdk_store_field(struct sdk_status *st, int field, uint32_t value) {
 
-        char answer_sdk[256];
-        char get_status[] = "TSC10173\r\n";
-        char word_2[] = "TSC11576\r\n";
-        char word_3[] = "TSC1C105000000000005\r\n";
-
-        fd = open_serial_port("/dev/ttyUSB0", 57600, 8, 1, 0);
-
-        if (fd != 0) {
-                while (1) {
-                        usleep(550000);
-                        /* init sdk and request status device */
-
-                        int len_message = sizeof(get_status) / sizeof(get_status[0]);
-                        len_answer_sdk = request_port(get_status, len_message, answer_sdk,
-                                        fd);
-
-                        while (len_answer_sdk <= 0) {
-                                int len_message = sizeof(get_status) / sizeof(get_status[0]);
-                                len_answer_sdk = request_port(get_status, len_message,
-                                                answer_sdk, fd);
-                                sleep(1);
-                                if (DEBUG) {
-                                        write_log("Not response from SDK");
-                                }
+        switch (field) {
+        case SDK_FIELD_HW:
+                st->hw = value;
+                break;
+        case SDK_FIELD_SW:
+                st->sw = value;
+                break;
+        case SDK_FIELD_TEMP:
+                st->self_temp = value;
+                break;
+        case SDK_FIELD_RELAY:
+                st->relay = value;
+                break;
+        case SDK_FIELD_DRY:
+                st->dry_contact = value;
+                break;
+        default:
+                st->reg[field - SDK_FIELD_REG] = value;
+                break;
+        }
+}
 
-                        }
+/*
+ * Validate an answer to cmd and decode its fields in one pass over the
+ * offsets of the command table. Nothing past len is touched and st is only
+ * written, field by field, for a valid answer.
+ */
+int sdk_decode_answer(const struct sdk_command_def *cmd, const char *frame, int len,
+                struct sdk_status *st) {
 
-                        /* parsing response data */
-
-                        /* internal temperature */
-                        char tmp_buf[2];
-                        tmp_buf[0] = answer_sdk[40];
-                        tmp_buf[1] = answer_sdk[41];
-                        sdk_serial->self_temp = ascii_to_int(tmp_buf);
-                       
-
-                        /* version hardware */
-                        tmp_buf[0] = answer_sdk[6];
-                        tmp_buf[1] = answer_sdk[7];
-                        sdk_serial->hw = ascii_to_int(tmp_buf);
-                      
-
-                        /* version software */
-                        tmp_buf[0] = answer_sdk[8];
-                        tmp_buf[1] = answer_sdk[9];
-                        sdk_serial->sw = ascii_to_int(tmp_buf);
-                        
-
-                        /* electromagnetic relay */
-                        sdk_serial->relay = answer_sdk[19];
-                        
-
-                        /* dry contact */
-                        i=0;
-                        for (i; i<20; i++) {
-                                sdk_serial->dry_contact[i] = answer_sdk[i+20];
-                        }
+        const unsigned char *p = (const unsigned char *) frame;
+        uint32_t value[SDK_MAX_CMD_FIELDS];
+        int i, echo;
 
-                        //--------------------------
-                        i = 0;
-                        while (i < len_answer_sdk) {
-                                printf("%d -- %d\n", answer_sdk[i] - '0', (unsigned char)answer_sdk[i]);
+        /* the answer echoes the start of the command */
+        echo = cmd->len - 2 < SERIAL_MATCH_LEN ? cmd->len - 2 : SERIAL_MATCH_LEN;
+        if (len < cmd->answer_len || len < echo + 2 || memcmp(frame, cmd->message, echo) != 0
+                        || frame[len - 2] != '\r' || frame[len - 1] != '\n') {
+                return (-1);
+        }
+        for (i = 0; i < cmd->nr_fields; i++) {
+                if (sdk_decode_field(p + cmd->field[i].offset, &cmd->field[i], &value[i]) < 0) {
+                        return (-1);
+                }
+        }
+        for (i = 0; i < cmd->nr_fields; i++) {
+                sdk_store_field(st, cmd->field[i].field, value[i]);
+        }
+        return 0;
+}
 
-                                i ++;
-                        }
-                        //--------------------------
+static void sdk_add_change(struct sdk_delta *delta, int field, long old_value,
+                long new_value) {
+
+        struct sdk_change *c = &delta->change[delta->nr_changes++];
+
+        delta->mask |= 1UL << field;
+        c->field = field;
+        c->old_value = old_value;
+        c->new_value = new_value;
+}
+
+/*
+ * Fill delta with every field that differs between old and new, and every
+ * field of the seed mask even if it did not, in field order. Returns the
+ * number of changes, delta->device and ->time are left to the caller.
+ */
+int sdk_diff_status(const struct sdk_status *old, const struct sdk_status *new,
+                uint32_t seed, struct sdk_delta *delta) {
+
+        uint32_t contacts;
+        int i;
 
+        delta->mask = 0;
+        delta->nr_changes = 0;
+        if (old->hw != new->hw || (seed & 1UL << SDK_FIELD_HW)) {
+                sdk_add_change(delta, SDK_FIELD_HW, old->hw, new->hw);
+        }
+        if (old->sw != new->sw || (seed & 1UL << SDK_FIELD_SW)) {
+                sdk_add_change(delta, SDK_FIELD_SW, old->sw, new->sw);
+        }
+        if (old->self_temp != new->self_temp || (seed & 1UL << SDK_FIELD_TEMP)) {
+                sdk_add_change(delta, SDK_FIELD_TEMP, old->self_temp, new->self_temp);
+        }
+        if (old->relay != new->relay || (seed & 1UL << SDK_FIELD_RELAY)) {
+                sdk_add_change(delta, SDK_FIELD_RELAY, old->relay, new->relay);
+        }
+        /* only the contacts that flipped or are seeded, lowest first */
+        contacts = (old->dry_contact ^ new->dry_contact)
+                        | (seed >> SDK_FIELD_DRY & ((1UL << SDK_NR_DRY_CONTACTS) - 1));
+        while (contacts != 0) {
+                i = __builtin_ctz(contacts);
+                contacts &= contacts - 1;
+                sdk_add_change(delta, SDK_FIELD_DRY + i, (old->dry_contact >> i) & 1,
+                                (new->dry_contact >> i) & 1);
+        }
+        for (i = 0; i < SDK_MAX_REGS; i++) {
+                if (old->reg[i] != new->reg[i] || (seed & 1UL << (SDK_FIELD_REG + i))) {
+                        sdk_add_change(delta, SDK_FIELD_REG + i, old->reg[i], new->reg[i]);
+                }
+        }
+        return delta->nr_changes;
+}
+
+/* register a change listener, before the poller thread is started */
+int sdk_add_listener(sdk_listener callback, void *arg) {
+
+        if (m_nr_listeners >= SDK_MAX_LISTENERS) {
+                return -1;
+        }
+        m_listeners[m_nr_listeners].callback = callback;
+        m_listeners[m_nr_listeners].arg = arg;
+        m_nr_listeners++;
+        return 0;
+}
+
+/* write the changed fields through to the controller's state */
+static void sdk_apply_delta(struct sdk_state *state, const struct sdk_delta *delta) {
 
-                        /* send word_2 */
-                        len_message = sizeof(word_2) / sizeof(word_2[0]);
-                        len_answer_sdk = request_port(word_2, len_message, answer_sdk, fd);
+        const struct sdk_change *c;
+        int i;
 
-                        //--------------------------
-                        i = 0;
-                        while (i < len_answer_sdk) {
-                                printf("%c", answer_sdk[i]);
-                                i ++;
+        for (i = 0; i < delta->nr_changes; i++) {
+                c = &delta->change[i];
+                switch (c->field) {
+                case SDK_FIELD_HW:
+                        state->hw = c->new_value;
+                        break;
+                case SDK_FIELD_SW:
+                        state->sw = c->new_value;
+                        break;
+                case SDK_FIELD_TEMP:
+                        state->self_temp = c->new_value;
+                        break;
+                case SDK_FIELD_RELAY:
+                        state->relay = c->new_value;
+                        break;
+                default:
+                        if (c->field >= SDK_FIELD_REG) {
+                                state->reg[c->field - SDK_FIELD_REG] = c->new_value;
+                        } else {
+                                sdk_state_set_dry(state, c->field - SDK_FIELD_DRY,
+                                                c->new_value);
                         }
-                        //--------------------------
+                        break;
+                }
+        }
+}
+
+/* the fields an answer to cmd carries, as a delta mask */
+static uint32_t sdk_command_fields(const struct sdk_command_def *cmd) {
+
+        uint32_t mask = 0;
+        int i;
+
+        for (i = 0; i < cmd->nr_fields; i++) {
+                if (cmd->field[i].field == SDK_FIELD_DRY) {
+                        mask |= ((1UL << cmd->field[i].width) - 1) << SDK_FIELD_DRY;
+                } else {
+                        mask |= 1UL << cmd->field[i].field;
+                }
+        }
+        return mask;
+}
+
+static void sdk_update(struct sdk_port *port, int tag, const struct sdk_status *st) {
+
+        struct sdk_delta delta;
+        uint32_t seed = 0;
+        int i;
+
+        /* zero for the first answer, there is no earlier sample to bracket with */
+        delta.since = port->sent[tag];
+        port->sent[tag] = port->queue.sent_time;
+        /*
+         * The first answer lists all its fields, so every field gets a first
+         * sample, also one that starts out as 0 and never changes.
+         */
+        if (delta.since.tv_sec == 0 && delta.since.tv_nsec == 0) {
+                seed = sdk_command_fields(&sdk_table.command[tag]);
+        }
+        if (sdk_diff_status(&port->status, st, seed, &delta) == 0) {
+                return;
+        }
+        port->status = *st;
+        delta.device = port->index;
+        delta.time = port->queue.rx_time;
+        sdk_apply_delta(&port->state, &delta);
+        for (i = 0; i < m_nr_listeners; i++) {
+                m_listeners[i].callback(m_listeners[i].arg, &delta);
+        }
+        /* after the listeners, a new generation also covers what they recorded */
+        sdk_state_publish(port->index, &port->state);
+}
+
+/* online/offline transitions are logged once each, not per failed poll */
+static void sdk_port_online(struct sdk_port *port, int online) {
+
+        char msg[128];
+
+        if (sdk_state_online(&port->state) == online) {
+                return;
+        }
+        sdk_state_set_online(&port->state, online);
+        sdk_state_publish(port->index, &port->state);
+        if (online) {
+                snprintf(msg, sizeof (msg), "SDK on %s online", port->device);
+        } else {
+                snprintf(msg, sizeof (msg), "SDK on %s offline, %lu invalid answers",
+                                port->device, port->invalid);
+        }
+        write_log(msg);
+        port->invalid = 0;
+}
+
+/*
+ * Start from the state saved by an earlier run, marked stale. The decoded
+ * status is rebuilt from it so the first answers only report what changed
+ * in between.
+ */
+static void sdk_port_restore(struct sdk_port *port) {
+
+        int i;
+
+        if (sdk_persist_load(port->index, &port->state) < 0) {
+                return;
+        }
+        sdk_state_set_online(&port->state, 0);
+        sdk_state_set_stale(&port->state, 1);
+        port->status.hw = sdk_state_hw(&port->state);
+        port->status.sw = sdk_state_sw(&port->state);
+        port->status.self_temp = sdk_state_temp(&port->state);
+        port->status.relay = sdk_state_relay(&port->state);
+        port->status.dry_contact = sdk_state_contacts(&port->state);
+        for (i = 0; i < SDK_MAX_REGS; i++) {
+                port->status.reg[i] = sdk_state_reg(&port->state, i);
+        }
+        sdk_state_publish(port->index, &port->state);
+}
+
+/* restored values are stale until every command has been answered once */
+static void sdk_port_refreshed(struct sdk_port *port, int tag) {
+
+        port->answered |= 1U << tag;
+        if (sdk_state_stale(&port->state)
+                        && port->answered == (1U << sdk_table.nr_commands) - 1) {
+                sdk_state_set_stale(&port->state, 0);
+                sdk_state_publish(port->index, &port->state);
+        }
+}
+
+/*
+ * Auto-baud probe, driven by the poller like any other transaction: the port
+ * is switched to a rate, command 0 queued and the next rate tried once it
+ * expired twice, so a silent port never holds up the others.
+ */
+static void sdk_probe_rate(struct sdk_port *port, int rate) {
+
+        char msg[128];
+
+        for (; rate < SDK_NR_PROBE_RATES; rate++) {
+                if (serial_set_baud(port->fd, m_probe_rates[rate]) == 0) {
+                        /* bytes of the old rate are garbage at the new one */
+                        serial_ring_init(&port->queue.ring);
+                        port->probe = rate;
+                        port->probe_attempt = 0;
+                        port->baud = m_probe_rates[rate];
+                        return;
+                }
+        }
+        serial_set_baud(port->fd, sdk_baud_rate);
+        serial_ring_init(&port->queue.ring);
+        port->probe = -1;
+        port->baud = sdk_baud_rate;
+        snprintf(msg, sizeof (msg), "No SDK answer on %s, staying at %ld baud",
+                        port->device, sdk_baud_rate);
+        write_log(msg);
+}
 
+static void sdk_probe_answer(struct sdk_port *port, const char *frame, int len) {
 
-                        /*  send word_3  */
-                        len_message = sizeof(word_3) / sizeof(word_3[0]);
-                        len_answer_sdk = request_port(word_3, len_message, answer_sdk, fd);
+        struct sdk_command_def *cmd = &sdk_table.command[0];
+        struct sdk_status st;
+        char msg[128];
+
+        if (len > 0 && sdk_decode_answer(cmd, frame, len, &st) == 0) {
+                port->probe = -1;
+                snprintf(msg, sizeof (msg), "SDK on %s answers at %ld baud",
+                                port->device, port->baud);
+                write_log(msg);
+                return;
+        }
+        /* the first answer after a switch may still be garbled */
+        if (++port->probe_attempt >= 2) {
+                sdk_probe_rate(port, port->probe + 1);
+        }
+}
+
+static void sdk_answer(void *arg, int tag, const char *frame, int len) {
+
+        struct sdk_port *port = (struct sdk_port *) arg;
+        struct sdk_command_def *cmd = &sdk_table.command[tag];
+        struct sdk_status st = port->status;
+        int failures;
+
+        if (port->probe >= 0) {
+                sdk_probe_answer(port, frame, len);
+                return;
+        }
+        /* garbage counts as no answer and never reaches the shared state */
+        if (len > 0 && sdk_decode_answer(cmd, frame, len, &st) < 0) {
+                port->invalid++;
+                len = -1;
+        }
+        failures = sched_answer(&port->sched, tag, frame, len, serial_now_ms());
+        if (failures == 0 && cmd->nr_fields > 0) {
+                sdk_update(port, tag, &st);
+        }
+        if (failures == 0) {
+                sdk_port_refreshed(port, tag);
+        }
+        /* command 0 decides whether the controller is online */
+        if (tag != 0) {
+                return;
+        }
+        if (failures == 0) {
+                sdk_port_online(port, 1);
+                return;
+        }
+        if (failures >= SDK_OFFLINE_FAILURES) {
+                sdk_port_online(port, 0);
+        }
+        if (failures >= SDK_REPROBE_FAILURES && sdk_baud_probe) {
+                /* the port is closed by the poller, not under the queue */
+                port->reprobe = 1;
+        }
+}
+
+static void sdk_port_close(struct sdk_port *port, int epfd, long now) {
+
+        epoll_ctl(epfd, EPOLL_CTL_DEL, port->fd, NULL);
+        close(port->fd);
+        port->fd = -1;
+        sdk_port_online(port, 0);
+        port->next_poll = now + SDK_REOPEN_MS;
+        /* whatever was queued is lost with the port */
+        serial_queue_init(&port->queue, -1, sdk_pipeline_depth, sdk_answer, port);
+}
+
+static void sdk_port_open(struct sdk_port *port, int epfd, long now) {
+
+        struct epoll_event ev;
+        struct sdk_command_def *cmd;
+        int fd, i;
 
-                };
-        } 
-       
+        port->next_poll = now + SDK_REOPEN_MS;
+        fd = open_serial_port(port->device, sdk_baud_rate, 8, 1, 0);
+        if (fd <= 0) {
+                return;
+        }
+        port->baud = sdk_baud_rate;
+        port->probe = -1;
+        port->reprobe = 0;
+        ev.events = EPOLLIN;
+        ev.data.ptr = port;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                write_log("Could not watch serial port");
+                close(fd);
+                return;
+        }
+        port->fd = fd;
+        serial_queue_init(&port->queue, fd, sdk_pipeline_depth, sdk_answer, port);
+        sched_init(&port->sched);
+        /* commands are tagged with their index in the table */
+        for (i = 0; i < sdk_table.nr_commands; i++) {
+                cmd = &sdk_table.command[i];
+                sched_add(&port->sched, i, cmd->priority, cmd->period_min, cmd->period_max);
+        }
+        if (sdk_baud_probe) {
+                sdk_probe_rate(port, 0);
+        }
 }
 
+/* queue every due command, most important first, up to the pipeline depth */
+static void sdk_port_schedule(struct sdk_port *port, long now) {
+
+        struct sched_entry *e;
+        struct sdk_command_def *cmd;
+
+        if (port->probe >= 0) {
+                /* one probe at a time, command 0 is tagged 0 */
+                cmd = &sdk_table.command[0];
+                if (serial_queue_depth(&port->queue) == 0) {
+                        serial_queue_push(&port->queue, cmd->message, cmd->len, 0,
+                                        serial_deadline_ms(port->baud,
+                                                cmd->len + SDK_ANSWER_MAX));
+                }
+                return;
+        }
+        while (serial_queue_depth(&port->queue) < sdk_pipeline_depth) {
+                e = sched_next_due(&port->sched, now);
+                if (e == NULL) {
+                        break;
+                }
+                cmd = &sdk_table.command[e->tag];
+                /* answers already in flight are on the wire ahead of this one */
+                if (serial_queue_push(&port->queue, cmd->message, cmd->len, e->tag,
+                                serial_deadline_ms(port->baud,
+                                        (cmd->len + SDK_ANSWER_MAX) * sdk_pipeline_depth)) < 0) {
+                        break;
+                }
+                e->queued = 1;
+        }
+}
+
+/* milliseconds this port may sleep before it needs attention again */
+static long sdk_port_wait(struct sdk_port *port, long now) {
+
+        long wait, due;
+
+        if (port->fd < 0) {
+                wait = port->next_poll - now;
+                return wait < 0 ? 0 : wait;
+        }
+        wait = serial_queue_timeout(&port->queue, now);
+        if (wait < 0 && serial_queue_depth(&port->queue) > 0) {
+                /* pending but not written yet, port is busy */
+                wait = SERIAL_TIMEOUT_MS;
+        }
+        if (port->probe < 0 && serial_queue_depth(&port->queue) < sdk_pipeline_depth) {
+                due = sched_wait(&port->sched, now);
+                if (due >= 0 && (wait < 0 || due < wait)) {
+                        wait = due;
+                }
+        }
+        return wait;
+}
+
+/*
+ * One thread drives every configured controller: each port gets its own
+ * command queue and published state slot n, all of them multiplexed
+ * on a single epoll set. Ports that fail are closed and reopened later.
+ */
+void * threading_sdk_serial(void * arg) {
+        struct epoll_event events[MAX_NR_SDK];
+        struct sdk_port *port;
+        long now, wait;
+        int epfd, timeout, nfds, i, n;
+
+        epfd = epoll_create(MAX_NR_SDK);
+        if (epfd < 0) {
+                write_log("Crash epoll for serial ports");
+                return NULL;
+        }
+
+        now = serial_now_ms();
+        for (i = 0; i < sdk_device_list_length; i++) {
+                port = &m_ports[i];
+                port->device = sdk_device_list[i];
+                port->index = i;
+                port->fd = -1;
+                port->probe = -1;
+                sdk_port_restore(port);
+                sdk_port_open(port, epfd, now);
+                if (port->fd < 0) {
+                        write_log("Could not open serial port, will retry");
+                }
+        }
+
+        while (1) {
+                now = serial_now_ms();
+                timeout = -1;
+                for (i = 0; i < sdk_device_list_length; i++) {
+                        port = &m_ports[i];
+                        if (port->fd < 0) {
+                                if (now - port->next_poll >= 0) {
+                                        sdk_port_open(port, epfd, now);
+                                }
+                        }
+                        if (port->fd >= 0) {
+                                sdk_port_schedule(port, now);
+                                serial_queue_send(&port->queue);
+                        }
+                        wait = sdk_port_wait(port, now);
+                        if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+                                timeout = wait;
+                        }
+                }
+                if (timeout < 0) {
+                        timeout = SDK_REOPEN_MS;
+                }
+
+                nfds = epoll_wait(epfd, events, MAX_NR_SDK, timeout);
+                if (nfds < 0 && errno != EINTR) {
+                        write_log("Crash epoll for serial ports");
+                        break;
+                }
+
+                now = serial_now_ms();
+                for (n = 0; n < nfds; n++) {
+                        port = (struct sdk_port *) events[n].data.ptr;
+                        if (port->fd < 0) {
+                                continue;
+                        }
+                        if ((events[n].events & (EPOLLERR | EPOLLHUP))
+                                        || serial_queue_read(&port->queue) < 0) {
+                                write_log("Serial port failed");
+                                sdk_port_close(port, epfd, now);
+                        }
+                }
+                for (i = 0; i < sdk_device_list_length; i++) {
+                        port = &m_ports[i];
+                        if (port->fd >= 0) {
+                                serial_queue_expire(&port->queue, now);
+                        }
+                        if (port->fd >= 0 && port->reprobe) {
+                                write_log("SDK stopped answering, probing baud rate again");
+                                sdk_port_close(port, epfd, now);
+                                port->next_poll = now;
+                        }
+                }
+        }
+        close(epfd);
+        return NULL;
+}
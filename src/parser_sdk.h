@@ -1,15 +1,83 @@
 #ifndef PARSER_SDK_H_
 #define PARSER_SDK_H_
 
-struct sdk_param {
-	long int hw;
-	long int sw;
-	long int self_temp;
-	long int relay;
-	int optical_relay[4];
-	long int dry_contact[20];
+#include <stdint.h>
+#include <time.h>
+
+#define SDK_NR_DRY_CONTACTS	20
+/* registers beyond the status fields the command table can poll */
+#define SDK_MAX_REGS		8
+
+/* decoded answers, bit n of dry_contact is contact n + 1 */
+struct sdk_status {
+	uint32_t dry_contact;
+	uint8_t hw;
+	uint8_t sw;
+	uint8_t self_temp;
+	uint8_t relay;
+	uint32_t reg[SDK_MAX_REGS];
+};
+
+/* fields of a controller a change set can name, bit n of the mask is field n */
+enum sdk_field {
+	SDK_FIELD_HW,
+	SDK_FIELD_SW,
+	SDK_FIELD_TEMP,
+	SDK_FIELD_RELAY,
+	SDK_FIELD_DRY,		/* dry contact 1, contact n is SDK_FIELD_DRY + n - 1 */
+	SDK_FIELD_REG = SDK_FIELD_DRY + SDK_NR_DRY_CONTACTS,	/* register 0 */
+	SDK_NR_FIELDS = SDK_FIELD_REG + SDK_MAX_REGS
 };
 
+struct sdk_change {
+	int field;
+	long old_value;
+	long new_value;
+};
+
+/*
+ * What one status frame changed, only the first nr_changes entries are set.
+ * The controller still showed the old values when the previous status
+ * command was written (since, zero for the first frame) and the new ones by
+ * the time the first byte of this frame arrived (time), CLOCK_MONOTONIC.
+ * The first frame of a command lists every field it carries, unchanged
+ * ones too, so that each field has a first value.
+ */
+struct sdk_delta {
+	int device;
+	uint32_t mask;
+	int nr_changes;
+	struct timespec since;
+	struct timespec time;
+	struct sdk_change change[SDK_NR_FIELDS];
+};
+
+/* called from the poller thread for every status frame that changed something */
+typedef void (*sdk_listener)(void *arg, const struct sdk_delta *delta);
+
+#define SDK_MAX_LISTENERS 8
+
+/* controllers one poller thread can drive, one serial port each */
+#define MAX_NR_SDK 32
+/*
+ * Commands kept in flight per controller (-P). Pipelining is not documented
+ * for the SDK 5.3 firmware, so by default the next command is only sent once
+ * the previous one is answered or timed out.
+ */
+#define SDK_PIPELINE_DEPTH 1
+
+extern char *sdk_device_list[MAX_NR_SDK];
+extern int sdk_device_list_length;
+extern long sdk_baud_rate;
+extern int sdk_baud_probe;
+extern int sdk_pipeline_depth;
+
+struct sdk_command_def;
+
+int sdk_decode_answer(const struct sdk_command_def *, const char *, int, struct sdk_status *);
+int sdk_diff_status(const struct sdk_status *, const struct sdk_status *, uint32_t,
+		struct sdk_delta *);
+int sdk_add_listener(sdk_listener, void *);
 void * threading_sdk_serial(void * arg);
 
 #endif /*PARSER_SDK_H_*/
@@ -1,4 +1,5 @@
 #include <stdio.h>   /* Standard input/output definitions */
+#include <stdlib.h>
 #include <string.h>  /* String function definitions */
 #include <pthread.h> 
 #include <unistd.h>  /* UNIX standard function definitions */
@@ -7,26 +8,119 @@
 #include <errno.h>   /* Error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
 #include <stdint.h>
+#include <getopt.h>
 
 
 #include "parser_sdk.h"
 #include "mini_snmpd.h"
 #include "log.h"
+#include "serial.h"
 #include "server.h"
+#include "sdk_edge.h"
+#include "sdk_table.h"
+#include "sdk_history.h"
+#include "sdk_persist.h"
+#include "sdk_shm.h"
 
 
-extern struct sdk_param external_sdk_53;
+static void print_help(void)
+{
+	fprintf(stderr, "usage: sdk [-d device[,device...]] [-b baud|auto] [-c commands] [-P depth] [-H depth] [-S file] [-T threads] [-m conns]\n");
+	fprintf(stderr, "  -d  serial ports of the SDK 5.3 controllers (default /dev/ttyUSB0)\n");
+	fprintf(stderr, "  -b  serial baud rate (default 57600), \"auto\" probes the fastest rate\n");
+	fprintf(stderr, "      the controller answers at and falls back to 57600\n");
+	fprintf(stderr, "  -c  command table to poll (default built-in, see sdk.conf)\n");
+	fprintf(stderr, "  -P  commands in flight per controller (default %d, max %d), more than 1\n",
+			SDK_PIPELINE_DEPTH, SERIAL_QUEUE_SIZE);
+	fprintf(stderr, "      only for controllers known to answer pipelined commands in order\n");
+	fprintf(stderr, "  -H  changes kept per value for get_history (default %d, 0 disables)\n",
+			SDK_HISTORY_DEPTH);
+	fprintf(stderr, "  -S  file keeping the last state and history over restarts\n");
+	fprintf(stderr, "      (default %s)\n", SDK_PERSIST_FILE);
+	fprintf(stderr, "  -T  event loop threads of the TCP server on port 32001 (default 1, max %d)\n",
+			SERVER_MAX_THREADS);
+	fprintf(stderr, "  -m  connections the TCP server holds at once (default %d)\n",
+			SERVER_DEFAULT_CONNS);
+}
 
-int main(void) {
+int main(int argc, char *argv[]) {
 	
 	pthread_t thread;
+	char *commands = NULL;
+	struct sdk_shm *shm;
+	char *state_file = SDK_PERSIST_FILE;
+	int history = SDK_HISTORY_DEPTH;
+	int server_threads = 1;
+	int server_conns = SERVER_DEFAULT_CONNS;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:b:c:P:H:S:T:m:h")) != -1) {
+		switch (c) {
+		case 'd':
+			sdk_device_list_length = split(optarg, ",", sdk_device_list, MAX_NR_SDK);
+			break;
+		case 'b':
+			if (strcmp(optarg, "auto") == 0) {
+				sdk_baud_probe = 1;
+			} else {
+				sdk_baud_rate = atol(optarg);
+			}
+			break;
+		case 'c':
+			commands = optarg;
+			break;
+		case 'P':
+			sdk_pipeline_depth = atoi(optarg);
+			if (sdk_pipeline_depth < 1 || sdk_pipeline_depth > SERIAL_QUEUE_SIZE) {
+				print_help();
+				exit(EXIT_ARGS);
+			}
+			break;
+		case 'H':
+			history = atoi(optarg);
+			break;
+		case 'S':
+			state_file = optarg;
+			break;
+		case 'T':
+			server_threads = atoi(optarg);
+			break;
+		case 'm':
+			server_conns = atoi(optarg);
+			break;
+		default:
+			print_help();
+			exit(EXIT_ARGS);
+		}
+	}
+	if (sdk_table_load(commands) < 0) {
+		exit(EXIT_ARGS);
+	}
+	if (sdk_device_list_length == 0) {
+		sdk_device_list[sdk_device_list_length++] = "/dev/ttyUSB0";
+	}
 
 	//----------thread serial exchange---------------
 	
 	int thread_serial;
         int thread_snmpd;
 
-	thread_serial = pthread_create(&thread, NULL, &threading_sdk_serial, &external_sdk_53);
+	sdk_edge_init(sdk_device_list_length);
+	/* without a usable file the daemon starts from nothing, as before */
+	sdk_persist_open(state_file, sdk_device_list, sdk_device_list_length, history);
+	if (sdk_history_init(sdk_device_list_length, history, sdk_persist_history()) < 0) {
+		exit(EXIT_SYSCALL);
+	}
+	/* local readers map the states directly, see sdk_shm.h */
+	shm = sdk_shm_create(SDK_SHM_NAME, sdk_device_list_length);
+	if (shm != NULL) {
+		sdk_state_share(shm->slot);
+	} else {
+		write_log("Could not export SDK state to shared memory");
+	}
+	/* the server's change listener has to be in place before the poller runs */
+	server_init(server_threads, server_conns);
+	thread_serial = pthread_create(&thread, NULL, &threading_sdk_serial, NULL);
 
 	if (thread_serial != 0) {
 		write_log("Crash thread serial exchange");
@@ -38,18 +132,8 @@ int main(void) {
 	
 	//-----------------------------------------------
 	
-	/*while (i<20) {
-
-		sleep(2);
-		int i=0;
-		for (i; i<20; i++) {
-
-			printf("dry contact %d: %c\n", i, external_sdk_53.dry_contact[i]);
-		}
-		i++;
-	}*/
 	server_run();
 	thread_serial = pthread_join(thread, NULL);
 	
 	return (1);
-}
\ No newline at end of file
+}
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser_sdk.h"
+#include "sdk_edge.h"
+#include "log.h"
+
+/* one ring per dry contact of every configured controller */
+static struct sdk_edge_ring (*m_rings)[SDK_NR_DRY_CONTACTS];
+static int m_nr_devices = 0;
+
+static void sdk_edge_push(struct sdk_edge_ring *ring, const struct sdk_delta *delta,
+		int level) {
+
+	struct sdk_edge *e = &ring->edge[ring->head & SDK_EDGE_RING_MASK];
+
+	e->after = delta->since;
+	e->before = delta->time;
+	e->level = level;
+	/* the slot must be complete before readers can see it */
+	__sync_synchronize();
+	ring->head++;
+}
+
+/* change listener, runs on the poller thread */
+static void sdk_edge_record(void *arg, const struct sdk_delta *delta) {
+
+	const struct sdk_change *c;
+	int i;
+
+	/* the first frame has nothing to compare against */
+	if (delta->since.tv_sec == 0 && delta->since.tv_nsec == 0) {
+		return;
+	}
+	if (delta->device >= m_nr_devices) {
+		return;
+	}
+	for (i = 0; i < delta->nr_changes; i++) {
+		c = &delta->change[i];
+		if (c->field >= SDK_FIELD_DRY
+				&& c->field < SDK_FIELD_DRY + SDK_NR_DRY_CONTACTS) {
+			sdk_edge_push(&m_rings[delta->device][c->field - SDK_FIELD_DRY],
+					delta, c->new_value);
+		}
+	}
+}
+
+/* allocate the rings and start recording, before the poller thread starts */
+int sdk_edge_init(int nr_devices) {
+
+	m_rings = calloc(nr_devices, sizeof (*m_rings));
+	if (m_rings == NULL) {
+		write_log("Could not allocate dry contact edge rings");
+		return (-1);
+	}
+	m_nr_devices = nr_devices;
+	return sdk_add_listener(sdk_edge_record, NULL);
+}
+
+/* edges recorded on a contact so far, counting those already overwritten */
+unsigned long sdk_edge_count(int device, int contact) {
+
+	if (device < 0 || device >= m_nr_devices || contact < 0
+			|| contact >= SDK_NR_DRY_CONTACTS) {
+		return 0;
+	}
+	return m_rings[device][contact].head;
+}
+
+/*
+ * Copy up to max edges of a contact, oldest first, starting with edge number
+ * since. Edges already overwritten are skipped, *next is where the following
+ * call should continue. Returns the number of edges copied, -1 for a bad
+ * device or contact.
+ */
+int sdk_edge_read(int device, int contact, unsigned long since,
+		struct sdk_edge *edges, int max, unsigned long *next) {
+
+	struct sdk_edge_ring *ring;
+	unsigned long head, start, lost;
+	int n = 0;
+
+	if (device < 0 || device >= m_nr_devices || contact < 0
+			|| contact >= SDK_NR_DRY_CONTACTS) {
+		return (-1);
+	}
+	ring = &m_rings[device][contact];
+
+	head = ring->head;
+	__sync_synchronize();
+	start = since;
+	if (head - start > SDK_EDGE_RING_SIZE) {
+		start = head - SDK_EDGE_RING_SIZE;
+	}
+	while (start + n != head && n < max) {
+		edges[n] = ring->edge[(start + n) & SDK_EDGE_RING_MASK];
+		n++;
+	}
+
+	/*
+	 * The writer may have lapped us while copying: slot head + 1 - SIZE
+	 * onwards is intact, anything older may be torn.
+	 */
+	__sync_synchronize();
+	head = ring->head;
+	if (head + 1 - start > SDK_EDGE_RING_SIZE) {
+		lost = head + 1 - SDK_EDGE_RING_SIZE - start;
+		if (lost >= n) {
+			start += lost;
+			n = 0;
+		} else {
+			memmove(edges, edges + lost, (n - lost) * sizeof (*edges));
+			start += lost;
+			n -= lost;
+		}
+	}
+	if (next) {
+		*next = start + n;
+	}
+	return n;
+}
@@ -0,0 +1,34 @@
+#ifndef SDK_EDGE_H_
+#define SDK_EDGE_H_
+
+#include <time.h>
+
+/* transitions kept per dry contact, a power of two */
+#define SDK_EDGE_RING_SIZE	16
+#define SDK_EDGE_RING_MASK	(SDK_EDGE_RING_SIZE - 1)
+
+/*
+ * One transition of a dry contact to level. The contact was still at the
+ * other level at after and had reached level by before (CLOCK_MONOTONIC),
+ * the edge lies in between.
+ */
+struct sdk_edge {
+	struct timespec after;
+	struct timespec before;
+	int level;
+};
+
+/*
+ * Written by the poller thread only, read without locks: head counts every
+ * edge ever written and is advanced after the slot is filled.
+ */
+struct sdk_edge_ring {
+	volatile unsigned long head;
+	struct sdk_edge edge[SDK_EDGE_RING_SIZE];
+};
+
+int sdk_edge_init(int);
+unsigned long sdk_edge_count(int, int);
+int sdk_edge_read(int, int, unsigned long, struct sdk_edge *, int, unsigned long *);
+
+#endif /*SDK_EDGE_H_*/
@@ -0,0 +1,466 @@
+/*
+ * SDK 5.3 controller emulator.
+ *
+ * Creates one pseudo-terminal per emulated controller and answers the
+ * commands the daemon polls (TSC10173 status, TSC11576 word_2, TSC1C1...
+ * word_3) with realistic frames. Latency, jitter, byte pacing (or a baud
+ * rate to pace at), dropped and corrupted answers and scripted dry
+ * contact/relay/temperature changes are configurable, so the serial path
+ * can be exercised and measured without Triada hardware:
+ *
+ *	./sdk_emu -n 2 -l 5 -j 2 -b 57600 &
+ *	./sdk -d /dev/pts/3,/dev/pts/4
+ *
+ * The slave device names are printed on stdout, one per line.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+
+#define EMU_MAX_DEVICES		32
+#define EMU_MAX_REPLIES		16
+#define EMU_FRAME_SIZE		128
+#define EMU_MAX_SCRIPT		256
+
+struct emu_reply {
+	char data[EMU_FRAME_SIZE];
+	int len;
+	int sent;
+	long long start_us;
+};
+
+struct emu_dev {
+	int master;
+	int slave;
+	char name[64];
+	char in[512];
+	int in_len;
+	struct emu_reply reply[EMU_MAX_REPLIES];
+	int reply_head;
+	int reply_count;
+	long long next_byte_us;
+	uint32_t dry_contact;
+	int relay;
+	int temp;
+	unsigned long commands;
+	unsigned long answers;
+	unsigned long dropped;
+	unsigned long corrupted;
+};
+
+struct emu_event {
+	long long at_us;
+	int dev;
+	char field[16];
+	int index;
+	int value;
+};
+
+static struct emu_dev m_dev[EMU_MAX_DEVICES];
+static int m_nr_dev = 1;
+static struct emu_event m_script[EMU_MAX_SCRIPT];
+static int m_script_length = 0;
+static int m_script_pos = 0;
+
+static int m_latency_us = 2000;
+static int m_jitter_us = 0;
+static int m_pace_us = 0;
+static int m_drop_pct = 0;
+static int m_corrupt_pct = 0;
+static int m_toggle_ms = 0;
+static long m_baud = 0;
+static int m_strict_baud = 0;
+static volatile int m_quit = 0;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void handle_signal(int signo)
+{
+	m_quit = 1;
+}
+
+static int open_pty(struct emu_dev *dev)
+{
+	struct termios tio;
+	char *name;
+
+	dev->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (dev->master < 0 || grantpt(dev->master) < 0 || unlockpt(dev->master) < 0) {
+		perror("posix_openpt");
+		return -1;
+	}
+	name = ptsname(dev->master);
+	if (name == NULL) {
+		perror("ptsname");
+		return -1;
+	}
+	snprintf(dev->name, sizeof (dev->name), "%s", name);
+
+	/* Keep the slave open so the master never sees EIO between clients */
+	dev->slave = open(dev->name, O_RDWR | O_NOCTTY);
+	if (dev->slave < 0) {
+		perror(dev->name);
+		return -1;
+	}
+	tcgetattr(dev->slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(dev->slave, TCSANOW, &tio);
+	return 0;
+}
+
+static int load_script(const char *filename)
+{
+	struct emu_event *ev;
+	char line[128];
+	FILE *fp;
+	long ms;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		perror(filename);
+		return -1;
+	}
+	while (fgets(line, sizeof (line), fp) != NULL && m_script_length < EMU_MAX_SCRIPT) {
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		ev = &m_script[m_script_length];
+		ev->index = 0;
+		/* "<ms> <device> dry <contact> <0|1>", "<ms> <device> relay <0|1>", ... */
+		if (sscanf(line, "%ld %d %15s %d %d", &ms, &ev->dev, ev->field,
+				&ev->index, &ev->value) == 5) {
+			ev->index--;
+		} else if (sscanf(line, "%ld %d %15s %d", &ms, &ev->dev, ev->field,
+				&ev->value) != 4) {
+			fprintf(stderr, "%s: bad line: %s", filename, line);
+			continue;
+		}
+		ev->at_us = ms * 1000LL;
+		m_script_length++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void apply_event(const struct emu_event *ev)
+{
+	struct emu_dev *dev;
+
+	if (ev->dev < 0 || ev->dev >= m_nr_dev) {
+		return;
+	}
+	dev = &m_dev[ev->dev];
+	if (strcmp(ev->field, "dry") == 0 && ev->index >= 0 && ev->index < 20) {
+		if (ev->value) {
+			dev->dry_contact |= 1U << ev->index;
+		} else {
+			dev->dry_contact &= ~(1U << ev->index);
+		}
+	} else if (strcmp(ev->field, "relay") == 0) {
+		dev->relay = ev->value & 0x0F;
+	} else if (strcmp(ev->field, "temp") == 0) {
+		dev->temp = ev->value & 0xFF;
+	}
+}
+
+/* status frame: 58 characters and "\r\n", 60 bytes on the wire */
+static int build_status(struct emu_dev *dev, char *out)
+{
+	char contacts[21];
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		contacts[i] = (dev->dry_contact >> i) & 1 ? '1' : '0';
+	}
+	contacts[20] = '\0';
+	return sprintf(out, "TSC101%02X%02X000000000%X%s%02X0000000000000000\r\n",
+		0x01, 0x02, dev->relay, contacts, dev->temp);
+}
+
+static void queue_reply(struct emu_dev *dev, const char *cmd, int len)
+{
+	struct emu_reply *r;
+	long long start;
+	int jitter;
+
+	dev->commands++;
+	if (dev->reply_count >= EMU_MAX_REPLIES) {
+		dev->dropped++;
+		return;
+	}
+	if (m_drop_pct && rand() % 100 < m_drop_pct) {
+		dev->dropped++;
+		return;
+	}
+	r = &dev->reply[(dev->reply_head + dev->reply_count) % EMU_MAX_REPLIES];
+	if (len >= 8 && memcmp(cmd, "TSC10173", 8) == 0) {
+		r->len = build_status(dev, r->data);
+	} else if (len >= 8 && memcmp(cmd, "TSC11576", 8) == 0) {
+		r->len = sprintf(r->data, "TSC1157600\r\n");
+	} else if (len >= 6 && memcmp(cmd, "TSC1C1", 6) == 0) {
+		r->len = sprintf(r->data, "%.8s\r\n", cmd);
+	} else {
+		return;
+	}
+	if (m_corrupt_pct && rand() % 100 < m_corrupt_pct) {
+		/* flip a byte inside the payload, keep the terminator */
+		r->data[6 + rand() % (r->len - 8)] ^= 0x5A;
+		dev->corrupted++;
+	}
+	jitter = m_jitter_us ? rand() % (2 * m_jitter_us + 1) - m_jitter_us : 0;
+	start = now_us() + m_latency_us + jitter;
+	r->start_us = start;
+	r->sent = 0;
+	dev->reply_count++;
+}
+
+static speed_t baud_speed(long baud)
+{
+	switch (baud) {
+	case 9600:	return B9600;
+	case 19200:	return B19200;
+	case 38400:	return B38400;
+	case 57600:	return B57600;
+	case 115200:	return B115200;
+	case 230400:	return B230400;
+	}
+	return B0;
+}
+
+/* a real line at the wrong rate only delivers garbage */
+static int baud_matches(struct emu_dev *dev)
+{
+	struct termios tio;
+
+	if (tcgetattr(dev->slave, &tio) < 0) {
+		return 1;
+	}
+	return cfgetospeed(&tio) == baud_speed(m_baud);
+}
+
+static void handle_input(struct emu_dev *dev)
+{
+	char *end;
+	int n, len;
+
+	n = read(dev->master, dev->in + dev->in_len, sizeof (dev->in) - dev->in_len);
+	if (n <= 0) {
+		return;
+	}
+	if (m_strict_baud && !baud_matches(dev)) {
+		dev->in_len = 0;
+		return;
+	}
+	dev->in_len += n;
+	while ((end = memmem(dev->in, dev->in_len, "\r\n", 2)) != NULL) {
+		len = end - dev->in;
+		queue_reply(dev, dev->in, len);
+		dev->in_len -= len + 2;
+		memmove(dev->in, end + 2, dev->in_len);
+	}
+	if (dev->in_len == sizeof (dev->in)) {
+		dev->in_len = 0;
+	}
+}
+
+/* write what is due, returns microseconds until this device needs us again */
+static long long handle_output(struct emu_dev *dev, long long now)
+{
+	struct emu_reply *r;
+	int n, chunk;
+
+	while (dev->reply_count > 0) {
+		r = &dev->reply[dev->reply_head];
+		if (r->start_us > now) {
+			return r->start_us - now;
+		}
+		if (m_pace_us && dev->next_byte_us > now) {
+			return dev->next_byte_us - now;
+		}
+		chunk = m_pace_us ? 1 : r->len - r->sent;
+		n = write(dev->master, r->data + r->sent, chunk);
+		if (n <= 0) {
+			return 1000;
+		}
+		r->sent += n;
+		if (m_pace_us) {
+			dev->next_byte_us = (dev->next_byte_us > now - m_pace_us
+				? dev->next_byte_us : now) + m_pace_us;
+		}
+		if (r->sent == r->len) {
+			dev->answers++;
+			dev->reply_head = (dev->reply_head + 1) % EMU_MAX_REPLIES;
+			dev->reply_count--;
+			/* the next answer cannot start before this one left the wire */
+			if (dev->reply_count > 0) {
+				r = &dev->reply[dev->reply_head];
+				if (r->start_us < now) {
+					r->start_us = now;
+				}
+			}
+		}
+	}
+	return -1;
+}
+
+static void print_help(void)
+{
+	fprintf(stderr,
+		"usage: sdk_emu [-n devices] [-l latency_ms] [-j jitter_ms] [-p pace_us | -b baud [-B]]\n"
+		"               [-D drop_pct] [-C corrupt_pct] [-t toggle_ms] [-s script]\n"
+		"  -n  number of emulated controllers, one pty each (default 1)\n"
+		"  -l  delay between command and answer in ms (default 2)\n"
+		"  -j  random +/- jitter added to the delay in ms\n"
+		"  -p  delay between two answer bytes in us\n"
+		"  -b  pace answer bytes like a serial line at this baud rate (10 bits/byte)\n"
+		"  -B  ignore commands unless the port is set to the -b baud rate\n"
+		"  -D  percentage of commands left unanswered\n"
+		"  -C  percentage of answers with a corrupted byte\n"
+		"  -t  toggle dry contact 1 of every controller each toggle_ms\n"
+		"  -s  script of timed changes, lines of \"<ms> <dev> dry <n> <0|1>\",\n"
+		"      \"<ms> <dev> relay <v>\" or \"<ms> <dev> temp <v>\"\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd[EMU_MAX_DEVICES];
+	long long start, now, wait, next_toggle;
+	int timeout, c, i;
+
+	while ((c = getopt(argc, argv, "n:l:j:p:b:BD:C:t:s:h")) != -1) {
+		switch (c) {
+		case 'n':
+			m_nr_dev = atoi(optarg);
+			if (m_nr_dev < 1 || m_nr_dev > EMU_MAX_DEVICES) {
+				fprintf(stderr, "sdk_emu: 1..%d devices\n", EMU_MAX_DEVICES);
+				exit(1);
+			}
+			break;
+		case 'l':
+			m_latency_us = atof(optarg) * 1000;
+			break;
+		case 'j':
+			m_jitter_us = atof(optarg) * 1000;
+			break;
+		case 'p':
+			m_pace_us = atoi(optarg);
+			break;
+		case 'b':
+			m_baud = atol(optarg);
+			m_pace_us = 10000000 / m_baud;
+			break;
+		case 'B':
+			m_strict_baud = 1;
+			break;
+		case 'D':
+			m_drop_pct = atoi(optarg);
+			break;
+		case 'C':
+			m_corrupt_pct = atoi(optarg);
+			break;
+		case 't':
+			m_toggle_ms = atoi(optarg);
+			break;
+		case 's':
+			if (load_script(optarg) < 0) {
+				exit(1);
+			}
+			break;
+		default:
+			print_help();
+			exit(1);
+		}
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	srand(time(NULL));
+
+	for (i = 0; i < m_nr_dev; i++) {
+		memset(&m_dev[i], 0, sizeof (m_dev[i]));
+		m_dev[i].temp = 0x1A;
+		if (open_pty(&m_dev[i]) < 0) {
+			exit(1);
+		}
+		pfd[i].fd = m_dev[i].master;
+		pfd[i].events = POLLIN;
+		printf("%s\n", m_dev[i].name);
+	}
+	fflush(stdout);
+
+	start = now_us();
+	next_toggle = start + m_toggle_ms * 1000LL;
+	while (!m_quit) {
+		now = now_us();
+		while (m_script_pos < m_script_length
+				&& start + m_script[m_script_pos].at_us <= now) {
+			apply_event(&m_script[m_script_pos++]);
+		}
+		if (m_toggle_ms && next_toggle <= now) {
+			for (i = 0; i < m_nr_dev; i++) {
+				m_dev[i].dry_contact ^= 1;
+			}
+			next_toggle += m_toggle_ms * 1000LL;
+		}
+
+		wait = -1;
+		for (i = 0; i < m_nr_dev; i++) {
+			long long w = handle_output(&m_dev[i], now);
+			if (w >= 0 && (wait < 0 || w < wait)) {
+				wait = w;
+			}
+		}
+		if (m_script_pos < m_script_length) {
+			long long w = start + m_script[m_script_pos].at_us - now;
+			if (wait < 0 || w < wait) {
+				wait = w;
+			}
+		}
+		if (m_toggle_ms && (wait < 0 || next_toggle - now < wait)) {
+			wait = next_toggle - now;
+		}
+		/* poll() has millisecond resolution, spin-sleep the remainder */
+		if (wait >= 0 && wait < 1000) {
+			if (wait > 0) {
+				usleep(wait);
+			}
+			timeout = 0;
+		} else {
+			timeout = wait < 0 ? 1000 : wait / 1000;
+		}
+
+		if (poll(pfd, m_nr_dev, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < m_nr_dev; i++) {
+			if (pfd[i].revents & POLLIN) {
+				handle_input(&m_dev[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < m_nr_dev; i++) {
+		fprintf(stderr, "%s: commands %lu, answers %lu, dropped %lu, corrupted %lu\n",
+			m_dev[i].name, m_dev[i].commands, m_dev[i].answers,
+			m_dev[i].dropped, m_dev[i].corrupted);
+	}
+	return 0;
+}
@@ -0,0 +1,208 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser_sdk.h"
+#include "sdk_history.h"
+#include "log.h"
+
+/*
+ * Value history of every field of every controller: a ring of depth samples
+ * per field, one sample per change. Memory is allocated once at start-up,
+ * old samples are overwritten. A mutex per controller guards its rings, the
+ * poller holds it for one delta, readers for one copy.
+ *
+ * The rings may live in the state file and outlast the process. Every
+ * entry carries a check over its sequence number and contents, entries a
+ * crash left half written are found and their ring is dropped on start-up.
+ */
+struct sdk_history_entry {
+	struct sdk_sample sample;
+	uint32_t check;
+};
+
+struct sdk_history_store {
+	unsigned long head[SDK_NR_FIELDS];	/* samples ever written per field */
+	struct sdk_history_entry entry[];	/* SDK_NR_FIELDS rings of m_depth */
+};
+
+struct sdk_history {
+	pthread_mutex_t lock;
+	struct sdk_history_store *store;
+};
+
+static struct sdk_history *m_history;
+static int m_nr_devices = 0;
+static int m_depth = 0;
+
+static uint32_t sdk_history_check(unsigned long seq, const struct sdk_sample *s) {
+
+	uint32_t hash = 2166136261U;
+	uint32_t word[4];
+	const unsigned char *p = (const unsigned char *) word;
+	int i;
+
+	word[0] = seq;
+	word[1] = s->time.tv_sec;
+	word[2] = s->time.tv_nsec;
+	word[3] = s->value;
+	for (i = 0; i < sizeof (word); i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* change listener, runs on the poller thread */
+static void sdk_history_record(void *arg, const struct sdk_delta *delta) {
+
+	struct sdk_history *h;
+	struct sdk_history_entry *e;
+	const struct sdk_change *c;
+	unsigned long seq;
+	int i;
+
+	if (delta->device >= m_nr_devices) {
+		return;
+	}
+	h = &m_history[delta->device];
+	pthread_mutex_lock(&h->lock);
+	for (i = 0; i < delta->nr_changes; i++) {
+		c = &delta->change[i];
+		seq = h->store->head[c->field];
+		/* a first value the ring restored from the state file already ends with */
+		if (c->old_value == c->new_value && seq > 0 && h->store->entry[c->field * m_depth
+				+ (seq - 1) % m_depth].sample.value == c->new_value) {
+			continue;
+		}
+		e = &h->store->entry[c->field * m_depth + seq % m_depth];
+		e->sample.time = delta->time;
+		e->sample.value = c->new_value;
+		e->check = sdk_history_check(seq, &e->sample);
+		h->store->head[c->field] = seq + 1;
+	}
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* drop the rings of a store that do not check out, returns how many */
+static int sdk_history_verify(struct sdk_history_store *store) {
+
+	struct sdk_history_entry *e;
+	unsigned long seq, start;
+	int field, dropped = 0;
+
+	for (field = 0; field < SDK_NR_FIELDS; field++) {
+		start = store->head[field] > m_depth ? store->head[field] - m_depth : 0;
+		for (seq = start; seq != store->head[field]; seq++) {
+			e = &store->entry[field * m_depth + seq % m_depth];
+			if (e->check != sdk_history_check(seq, &e->sample)) {
+				store->head[field] = 0;
+				dropped++;
+				break;
+			}
+		}
+	}
+	return dropped;
+}
+
+/* bytes of storage the rings of one controller take at depth */
+size_t sdk_history_size(int depth) {
+
+	return sizeof (struct sdk_history_store)
+		+ SDK_NR_FIELDS * depth * sizeof (struct sdk_history_entry);
+}
+
+/*
+ * Start recording depth samples per field, 0 disables history. storage
+ * holds nr_devices times sdk_history_size(depth) bytes kept from an
+ * earlier run, or is NULL to allocate empty rings.
+ */
+int sdk_history_init(int nr_devices, int depth, void *storage) {
+
+	char msg[128];
+	int i, dropped = 0;
+
+	if (depth <= 0) {
+		return 0;
+	}
+	m_history = calloc(nr_devices, sizeof (*m_history));
+	if (storage == NULL) {
+		storage = calloc(nr_devices, sdk_history_size(depth));
+	}
+	if (m_history == NULL || storage == NULL) {
+		write_log("Could not allocate SDK history");
+		return (-1);
+	}
+	m_nr_devices = nr_devices;
+	m_depth = depth;
+	for (i = 0; i < nr_devices; i++) {
+		m_history[i].store = (struct sdk_history_store *)
+			((char *) storage + i * sdk_history_size(depth));
+		dropped += sdk_history_verify(m_history[i].store);
+		pthread_mutex_init(&m_history[i].lock, NULL);
+	}
+	if (dropped > 0) {
+		snprintf(msg, sizeof (msg), "Dropped %d damaged SDK history rings", dropped);
+		write_log(msg);
+	}
+	return sdk_add_listener(sdk_history_record, NULL);
+}
+
+/* samples kept per field, 0 when history is disabled */
+int sdk_history_depth(void) {
+
+	return m_depth;
+}
+
+static int sdk_timespec_before(const struct timespec *a, const struct timespec *b) {
+
+	return a->tv_sec < b->tv_sec
+		|| (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Copy up to max samples of a field, oldest first, from sample number from
+ * on. With since, the copy starts no earlier than the sample that was
+ * current at since, so the value over the whole interval is known. Samples
+ * already overwritten are skipped, *next is where the following call
+ * should continue. Returns the number of samples copied, -1 for a bad
+ * device or field.
+ */
+int sdk_history_read(int device, int field, const struct timespec *since,
+		unsigned long from, struct sdk_sample *samples, int max, unsigned long *next) {
+
+	struct sdk_history *h;
+	const struct sdk_history_entry *ring;
+	unsigned long head, start;
+	int n = 0;
+
+	if (device < 0 || device >= m_nr_devices || field < 0
+			|| field >= SDK_NR_FIELDS) {
+		return (-1);
+	}
+	h = &m_history[device];
+	pthread_mutex_lock(&h->lock);
+	ring = &h->store->entry[field * m_depth];
+	head = h->store->head[field];
+	start = head > m_depth ? head - m_depth : 0;
+	if (since) {
+		while (start + 1 < head
+				&& !sdk_timespec_before(since, &ring[(start + 1) % m_depth].sample.time)) {
+			start++;
+		}
+	}
+	if (from > start) {
+		start = from;
+	}
+	while (start + n < head && n < max) {
+		samples[n] = ring[(start + n) % m_depth].sample;
+		n++;
+	}
+	pthread_mutex_unlock(&h->lock);
+	if (next) {
+		*next = start + n;
+	}
+	return n;
+}
@@ -0,0 +1,23 @@
+#ifndef SDK_HISTORY_H_
+#define SDK_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* samples kept per field unless -H says otherwise */
+#define SDK_HISTORY_DEPTH	64
+
+/* a field took value at time (CLOCK_MONOTONIC) and kept it until the next sample */
+struct sdk_sample {
+	struct timespec time;
+	uint32_t value;
+};
+
+size_t sdk_history_size(int);
+int sdk_history_init(int, int, void *);
+int sdk_history_depth(void);
+int sdk_history_read(int, int, const struct timespec *, unsigned long,
+		struct sdk_sample *, int, unsigned long *);
+
+#endif /*SDK_HISTORY_H_*/
@@ -0,0 +1,142 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sdk_persist.h"
+#include "sdk_history.h"
+#include "log.h"
+
+/*
+ * Last known state and history kept in a memory mapped file, so a
+ * restarted daemon answers with them until the controllers are polled
+ * again. The file lives in /tmp: it outlasts the process, not a reboot,
+ * which keeps the CLOCK_MONOTONIC times in it meaningful. Writes go
+ * straight to the mapping, no msync is needed for that.
+ */
+
+static struct sdk_persist_header *m_header = NULL;
+static struct sdk_persist_record *m_records;
+static void *m_history;
+
+static uint32_t sdk_persist_checksum(const struct sdk_persist_record *r) {
+
+	const unsigned char *p = (const unsigned char *) r;
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < offsetof(struct sdk_persist_record, checksum); i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* history rings start past the records, 8 byte aligned */
+static size_t sdk_persist_history_offset(int nr_devices) {
+
+	size_t offset = sizeof (struct sdk_persist_header)
+		+ nr_devices * sizeof (struct sdk_persist_record);
+
+	return (offset + 7) & ~(size_t) 7;
+}
+
+/*
+ * Map filename for the controllers named in devices, with room for depth
+ * history samples per field. A file left by a different configuration is
+ * started over, so is the record of a controller on another port. Returns
+ * -1 if the file can not be used, the daemon then runs without one.
+ */
+int sdk_persist_open(const char *filename, char **devices, int nr_devices, int depth) {
+
+	struct sdk_persist_header *h;
+	struct stat sb;
+	size_t size;
+	int fd, i;
+
+	size = sdk_persist_history_offset(nr_devices);
+	if (depth > 0) {
+		size += nr_devices * sdk_history_size(depth);
+	}
+	fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		write_log("Could not open SDK state file");
+		return (-1);
+	}
+	if (fstat(fd, &sb) < 0 || (sb.st_size != size && ftruncate(fd, size) < 0)) {
+		write_log("Could not size SDK state file");
+		close(fd);
+		return (-1);
+	}
+	h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		write_log("Could not map SDK state file");
+		return (-1);
+	}
+
+	if (h->magic != SDK_PERSIST_MAGIC || h->version != SDK_PERSIST_VERSION
+			|| h->size != size || h->nr_devices != nr_devices
+			|| h->depth != depth) {
+		memset(h, 0, size);
+		h->magic = SDK_PERSIST_MAGIC;
+		h->version = SDK_PERSIST_VERSION;
+		h->size = size;
+		h->nr_devices = nr_devices;
+		h->depth = depth;
+	}
+	m_header = h;
+	m_records = (struct sdk_persist_record *) (h + 1);
+	m_history = depth > 0 ? (char *) h + sdk_persist_history_offset(nr_devices) : NULL;
+
+	for (i = 0; i < nr_devices; i++) {
+		if (strncmp(m_records[i].device, devices[i], SDK_PERSIST_NAME_SIZE) != 0) {
+			memset(&m_records[i], 0, sizeof (m_records[i]));
+			snprintf(m_records[i].device, SDK_PERSIST_NAME_SIZE, "%s", devices[i]);
+			/* its history belongs to whatever was on that port before */
+			if (m_history != NULL) {
+				memset((char *) m_history + i * sdk_history_size(depth), 0,
+						sdk_history_size(depth));
+			}
+		}
+	}
+	return 0;
+}
+
+/* the state a controller had when the file was last written, -1 if none */
+int sdk_persist_load(int device, struct sdk_state *state) {
+
+	struct sdk_persist_record *r;
+
+	if (m_header == NULL || device < 0 || device >= m_header->nr_devices) {
+		return (-1);
+	}
+	r = &m_records[device];
+	if (r->state.generation == 0 || r->checksum != sdk_persist_checksum(r)) {
+		return (-1);
+	}
+	*state = r->state;
+	return 0;
+}
+
+/* poller thread only, a write cut short leaves a record that fails its checksum */
+void sdk_persist_save(int device, const struct sdk_state *state) {
+
+	struct sdk_persist_record *r;
+
+	if (m_header == NULL || device < 0 || device >= m_header->nr_devices) {
+		return;
+	}
+	r = &m_records[device];
+	r->state = *state;
+	r->checksum = sdk_persist_checksum(r);
+}
+
+/* storage for sdk_history_init(), NULL without a file or without history */
+void *sdk_persist_history(void) {
+
+	return m_history;
+}
@@ -0,0 +1,39 @@
+#ifndef SDK_PERSIST_H_
+#define SDK_PERSIST_H_
+
+#include <stdint.h>
+
+#include "sdk_state.h"
+
+#define SDK_PERSIST_FILE	"/tmp/sdk.state"
+#define SDK_PERSIST_MAGIC	0x53444b53	/* "SDKS" */
+#define SDK_PERSIST_VERSION	1
+#define SDK_PERSIST_NAME_SIZE	64
+
+/*
+ * State file layout: the header, one record per controller, then the
+ * history rings of all controllers. A file whose header does not match
+ * the running configuration is started over.
+ */
+struct sdk_persist_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* of the whole file */
+	uint32_t nr_devices;
+	uint32_t depth;		/* history samples per field */
+	uint32_t reserved;
+};
+
+/* last published state of a controller, valid if checksum matches */
+struct sdk_persist_record {
+	char device[SDK_PERSIST_NAME_SIZE];
+	struct sdk_state state;
+	uint32_t checksum;
+};
+
+int sdk_persist_open(const char *, char **, int, int);
+int sdk_persist_load(int, struct sdk_state *);
+void sdk_persist_save(int, const struct sdk_state *);
+void *sdk_persist_history(void);
+
+#endif /*SDK_PERSIST_H_*/
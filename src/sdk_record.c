@@ -0,0 +1,53 @@
+#include <endian.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdk_record.h"
+#include "sdk_state.h"
+#include "sdk_table.h"
+
+/* compile time checks that the wire layout holds what a state does */
+typedef char sdk_record_regs[SDK_MAX_REGS <= SDK_RECORD_NR_REGS ? 1 : -1];
+typedef char sdk_record_size[sizeof (struct sdk_record) == 72 ? 1 : -1];
+
+static uint64_t sdk_record_ms(clockid_t clock) {
+
+	struct timespec now;
+
+	clock_gettime(clock, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * The record for device's state, in little-endian byte order. The state
+ * only keeps monotonic time, the wall clock time of the publish is taken
+ * as long ago as that, so a clock set after it does not matter.
+ */
+void sdk_record_fill(struct sdk_record *rec, int device, const struct sdk_state *st) {
+
+	uint64_t age = sdk_record_ms(CLOCK_MONOTONIC) - st->updated;
+	int i;
+
+	memset(rec, 0, sizeof (*rec));
+	rec->magic = htole32(SDK_RECORD_MAGIC);
+	rec->version = htole16(SDK_RECORD_VERSION);
+	rec->size = htole16(sizeof (*rec));
+	rec->generation = htole32(st->generation);
+	rec->updated_ms = htole64(st->updated);
+	rec->realtime_ms = htole64(sdk_record_ms(CLOCK_REALTIME) - age);
+	rec->device = device;
+	rec->flags = (sdk_state_online(st) ? SDK_RECORD_ONLINE : 0)
+			| (sdk_state_stale(st) ? SDK_RECORD_STALE : 0);
+	rec->hw = sdk_state_hw(st);
+	rec->sw = sdk_state_sw(st);
+	rec->self_temp = sdk_state_temp(st);
+	rec->relay = sdk_state_relay(st);
+	for (i = 0; i < SDK_NR_OPTICAL_RELAYS; i++) {
+		rec->optical_relay |= sdk_state_optical(st, i) << i;
+	}
+	rec->nr_regs = sdk_table.nr_regs;
+	rec->dry_contact = htole32(sdk_state_contacts(st));
+	for (i = 0; i < sdk_table.nr_regs; i++) {
+		rec->reg[i] = htole32(sdk_state_reg(st, i));
+	}
+}
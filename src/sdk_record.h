@@ -0,0 +1,44 @@
+#ifndef SDK_RECORD_H_
+#define SDK_RECORD_H_
+
+#include <stdint.h>
+
+#define SDK_RECORD_MAGIC	0x53444b52	/* "SDKR" */
+#define SDK_RECORD_VERSION	1
+#define SDK_RECORD_NR_REGS	8
+
+/* sdk_record.flags, the same bits as sdk_state.flags */
+#define SDK_RECORD_ONLINE	0x01
+#define SDK_RECORD_STALE	0x02
+
+/*
+ * The whole state of one controller as "get_all" on port 32001 sends it:
+ * fixed size, packed and little-endian whatever the router's byte order,
+ * so a client reads sizeof (struct sdk_record) bytes and casts them.
+ * Check magic, version and size first, a new version only ever appends.
+ * In a session the record is followed by "\n\n" like any answer.
+ */
+struct sdk_record {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;			/* sizeof (struct sdk_record) */
+	uint32_t generation;		/* of the state, bumped by every publish */
+	uint8_t device;
+	uint8_t flags;
+	uint8_t hw;
+	uint8_t sw;
+	uint64_t updated_ms;		/* CLOCK_MONOTONIC ms of the publish: router uptime */
+	uint64_t realtime_ms;		/* the same moment in CLOCK_REALTIME ms, Unix time */
+	uint8_t self_temp;
+	uint8_t relay;
+	uint8_t optical_relay;		/* bit n is optical relay n + 1 */
+	uint8_t nr_regs;		/* of reg[] in use */
+	uint32_t dry_contact;		/* bit n is contact n + 1 */
+	uint32_t reg[SDK_RECORD_NR_REGS];
+} __attribute__((packed));
+
+/* daemon side */
+struct sdk_state;
+void sdk_record_fill(struct sdk_record *, int, const struct sdk_state *);
+
+#endif /*SDK_RECORD_H_*/
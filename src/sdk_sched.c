@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>  /* String function definitions */
+
+#include "sdk_sched.h"
+
+/*
+ * Adaptive per-command polling. Every command has a priority and a period
+ * range: an answer that differs from the previous one drops the period to
+ * period_min, every unchanged answer stretches it by half until period_max.
+ * Busy inputs are sampled fast, quiet registers cost almost no bandwidth.
+ *
+ * A command whose answer is missing or invalid is retried after period_min,
+ * doubled on every further failure up to SCHED_BACKOFF_MAX, with random
+ * jitter so ports that failed together do not retry in lockstep.
+ */
+
+static unsigned long sched_fingerprint(const char *frame, int len) {
+
+	unsigned long hash = 2166136261UL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)frame[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static struct sched_entry *sched_find(struct sched *s, int tag) {
+
+	int i;
+
+	for (i = 0; i < s->length; i++) {
+		if (s->entry[i].tag == tag) {
+			return &s->entry[i];
+		}
+	}
+	return NULL;
+}
+
+void sched_init(struct sched *s) {
+
+	memset(s, 0, sizeof(*s));
+}
+
+int sched_add(struct sched *s, int tag, int priority, int period_min,
+		int period_max) {
+
+	struct sched_entry *e;
+
+	if (s->length >= SCHED_MAX_ENTRIES || period_min <= 0
+			|| period_max < period_min) {
+		return (-1);
+	}
+	e = &s->entry[s->length++];
+	memset(e, 0, sizeof(*e));
+	e->tag = tag;
+	e->priority = priority;
+	e->period_min = period_min;
+	e->period_max = period_max;
+	e->period = period_min;
+	return 0;
+}
+
+/* the most important command that is due and not already waiting for an answer */
+struct sched_entry *sched_next_due(struct sched *s, long now) {
+
+	struct sched_entry *e, *best = NULL;
+	int i;
+
+	for (i = 0; i < s->length; i++) {
+		e = &s->entry[i];
+		if (e->queued || now - e->next_due < 0) {
+			continue;
+		}
+		if (best == NULL || e->priority > best->priority
+				|| (e->priority == best->priority
+					&& e->next_due - best->next_due < 0)) {
+			best = e;
+		}
+	}
+	return best;
+}
+
+/* milliseconds until the next command falls due, -1 if all are queued */
+int sched_wait(struct sched *s, long now) {
+
+	long left, best = -1;
+	int i;
+
+	for (i = 0; i < s->length; i++) {
+		if (s->entry[i].queued) {
+			continue;
+		}
+		left = s->entry[i].next_due - now;
+		if (left < 0) {
+			left = 0;
+		}
+		if (best < 0 || left < best) {
+			best = left;
+		}
+	}
+	return best;
+}
+
+/* delay before retry number failures, between half and all of the backoff */
+static int sched_backoff(struct sched_entry *e) {
+
+	long delay = e->period_min;
+	int i;
+
+	for (i = 1; i < e->failures && delay < SCHED_BACKOFF_MAX; i++) {
+		delay *= 2;
+	}
+	if (delay > SCHED_BACKOFF_MAX) {
+		delay = SCHED_BACKOFF_MAX;
+	}
+	return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+/*
+ * Account for the answer to a command, len <= 0 for a timeout or a frame
+ * the caller rejected. Returns the number of failures in a row.
+ */
+int sched_answer(struct sched *s, int tag, const char *frame, int len,
+		long now) {
+
+	struct sched_entry *e = sched_find(s, tag);
+	unsigned long fingerprint;
+
+	if (e == NULL) {
+		return 0;
+	}
+	e->queued = 0;
+	if (len <= 0) {
+		e->failures++;
+		e->next_due = now + sched_backoff(e);
+		return e->failures;
+	}
+	e->failures = 0;
+	fingerprint = sched_fingerprint(frame, len);
+	if (fingerprint != e->fingerprint) {
+		e->period = e->period_min;
+	} else {
+		e->period += e->period / 2;
+		if (e->period > e->period_max) {
+			e->period = e->period_max;
+		}
+	}
+	e->fingerprint = fingerprint;
+	e->next_due = now + e->period;
+	return 0;
+}
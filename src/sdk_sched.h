@@ -0,0 +1,32 @@
+#ifndef SDK_SCHED_H_
+#define SDK_SCHED_H_
+
+/* commands one port can schedule */
+#define SCHED_MAX_ENTRIES	8
+/* ceiling of the retry backoff of a command that gets no valid answer */
+#define SCHED_BACKOFF_MAX	5000
+
+struct sched_entry {
+	int tag;
+	int priority;
+	int period_min;
+	int period_max;
+	int period;
+	long next_due;
+	int queued;
+	int failures;		/* answers missing or invalid in a row */
+	unsigned long fingerprint;
+};
+
+struct sched {
+	int length;
+	struct sched_entry entry[SCHED_MAX_ENTRIES];
+};
+
+void sched_init(struct sched *);
+int sched_add(struct sched *, int, int, int, int);
+struct sched_entry *sched_next_due(struct sched *, long);
+int sched_wait(struct sched *, long);
+int sched_answer(struct sched *, int, const char *, int, long);
+
+#endif /*SDK_SCHED_H_*/
@@ -0,0 +1,79 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "sdk_shm.h"
+
+/*
+ * Create or reuse the segment and size it for nr_devices. An existing one
+ * is kept so readers attached to it stay valid over a restart. Returns
+ * NULL if it can not be set up, the daemon then keeps its state private.
+ */
+struct sdk_shm *sdk_shm_create(const char *name, int nr_devices) {
+
+	struct sdk_shm *shm;
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof (*shm)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof (*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		return NULL;
+	}
+	shm->header.magic = SDK_SHM_MAGIC;
+	shm->header.version = SDK_SHM_VERSION;
+	shm->header.slot_size = sizeof (struct sdk_state_slot);
+	shm->header.nr_devices = nr_devices;
+	return shm;
+}
+
+/* map the daemon's segment read-only, NULL if it is missing or of another layout */
+const struct sdk_shm *sdk_shm_attach(const char *name) {
+
+	struct sdk_shm *shm;
+	int fd;
+
+	fd = shm_open(name ? name : SDK_SHM_NAME, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	shm = mmap(NULL, sizeof (*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		return NULL;
+	}
+	if (shm->header.magic != SDK_SHM_MAGIC || shm->header.version != SDK_SHM_VERSION
+			|| shm->header.slot_size != sizeof (struct sdk_state_slot)) {
+		munmap(shm, sizeof (*shm));
+		return NULL;
+	}
+	return shm;
+}
+
+int sdk_shm_devices(const struct sdk_shm *shm) {
+
+	return shm->header.nr_devices;
+}
+
+/* consistent copy of a controller's state without a system call, -1 for a bad device */
+int sdk_shm_read(const struct sdk_shm *shm, int device, struct sdk_state *state) {
+
+	if (device < 0 || device >= shm->header.nr_devices) {
+		return (-1);
+	}
+	sdk_state_copy(&shm->slot[device], state);
+	return 0;
+}
+
+void sdk_shm_detach(const struct sdk_shm *shm) {
+
+	munmap((void *) shm, sizeof (*shm));
+}
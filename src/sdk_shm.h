@@ -0,0 +1,39 @@
+#ifndef SDK_SHM_H_
+#define SDK_SHM_H_
+
+#include <stdint.h>
+
+#include "sdk_state.h"
+
+#define SDK_SHM_NAME		"/sdk_state"
+#define SDK_SHM_MAGIC		0x53444b4d	/* "SDKM" */
+#define SDK_SHM_VERSION		1
+
+/*
+ * Shared memory export of the published states, one seqlock slot per
+ * controller exactly as the daemon keeps them. Readers check magic,
+ * version and slot_size before trusting the layout, the daemon only ever
+ * appends to it under a new version.
+ */
+struct sdk_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_size;	/* sizeof (struct sdk_state_slot) */
+	uint32_t nr_devices;	/* slots in use */
+} __attribute__((aligned(SDK_STATE_LINE)));
+
+struct sdk_shm {
+	struct sdk_shm_header header;
+	struct sdk_state_slot slot[MAX_NR_SDK];
+};
+
+/* daemon side */
+struct sdk_shm *sdk_shm_create(const char *, int);
+
+/* reader library, link with libsdkshm.a */
+const struct sdk_shm *sdk_shm_attach(const char *);
+int sdk_shm_devices(const struct sdk_shm *);
+int sdk_shm_read(const struct sdk_shm *, int, struct sdk_state *);
+void sdk_shm_detach(const struct sdk_shm *);
+
+#endif /*SDK_SHM_H_*/
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sdk_shm.h"
+
+/*
+ * Print the state the daemon exports in shared memory, one "name value"
+ * line per value, for scripts and as an example of the reader library.
+ */
+
+static void print_help(void)
+{
+	fprintf(stderr, "usage: sdk_shm_read [-n device]\n");
+	fprintf(stderr, "  -n  controller to print, 0 for the first one of sdk -d (default 0)\n");
+}
+
+int main(int argc, char *argv[]) {
+
+	const struct sdk_shm *shm;
+	struct sdk_state st;
+	int device = 0, c, i;
+
+	while ((c = getopt(argc, argv, "n:h")) != -1) {
+		switch (c) {
+		case 'n':
+			device = atoi(optarg);
+			break;
+		default:
+			print_help();
+			exit(1);
+		}
+	}
+	shm = sdk_shm_attach(NULL);
+	if (shm == NULL) {
+		fprintf(stderr, "sdk_shm_read: no SDK state exported, is sdk running?\n");
+		exit(2);
+	}
+	if (sdk_shm_read(shm, device, &st) < 0) {
+		fprintf(stderr, "sdk_shm_read: no controller %d\n", device);
+		exit(1);
+	}
+	printf("generation %lu\n", (unsigned long) st.generation);
+	printf("online %d\n", sdk_state_online(&st));
+	printf("stale %d\n", sdk_state_stale(&st));
+	printf("hw %u\n", sdk_state_hw(&st));
+	printf("sw %u\n", sdk_state_sw(&st));
+	printf("temp %u\n", sdk_state_temp(&st));
+	printf("relay %u\n", sdk_state_relay(&st));
+	for (i = 0; i < SDK_NR_DRY_CONTACTS; i++) {
+		printf("dry%d %d\n", i + 1, sdk_state_dry(&st, i));
+	}
+	for (i = 0; i < SDK_NR_OPTICAL_RELAYS; i++) {
+		printf("optical%d %d\n", i + 1, sdk_state_optical(&st, i));
+	}
+	for (i = 0; i < SDK_MAX_REGS; i++) {
+		printf("reg%d %lu\n", i, sdk_state_reg(&st, i));
+	}
+	sdk_shm_detach(shm);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include <string.h>
+#include <time.h>
+
+#include "sdk_state.h"
+#include "sdk_persist.h"
+
+static struct sdk_state_slot m_local[MAX_NR_SDK];
+static struct sdk_state_slot *m_slots = m_local;
+
+/* compile time check that a slot still fits its cache line */
+typedef char sdk_state_slot_size[sizeof (struct sdk_state_slot) == SDK_STATE_LINE ? 1 : -1];
+
+/*
+ * Seqlock write: seq is odd while the state is copied in. It only ever
+ * moves forward, and one left odd by a writer that died mid-copy is
+ * written over without passing through an even value first.
+ */
+static void sdk_state_write(struct sdk_state_slot *slot, const struct sdk_state *state) {
+
+	unsigned int seq = slot->seq | 1;
+
+	slot->seq = seq;
+	__sync_synchronize();
+	memcpy(&slot->state, state, sizeof (slot->state));
+	__sync_synchronize();
+	slot->seq = seq + 1;
+}
+
+/*
+ * Move the slots to memory other processes can map, before the poller
+ * thread starts. What was published so far moves along, written like any
+ * publish so readers still attached to a reused segment never see a
+ * half-copied state.
+ */
+void sdk_state_share(struct sdk_state_slot *slots) {
+
+	int i;
+
+	for (i = 0; i < MAX_NR_SDK; i++) {
+		sdk_state_write(&slots[i], &m_slots[i].state);
+	}
+	__sync_synchronize();
+	m_slots = slots;
+}
+
+/* poller thread only: stamp state with the next generation, publish and save it */
+void sdk_state_publish(int device, struct sdk_state *state) {
+
+	struct sdk_state_slot *slot = &m_slots[device];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	state->generation++;
+	state->updated = (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	sdk_state_write(slot, state);
+
+	sdk_persist_save(device, state);
+}
+
+/* consistent copy of a controller's state, -1 for a device out of range */
+int sdk_state_read(int device, struct sdk_state *state) {
+
+	if (device < 0 || device >= MAX_NR_SDK) {
+		return (-1);
+	}
+	sdk_state_copy(&m_slots[device], state);
+	return 0;
+}
+
+/* generation of the last published state, 0 before the first one */
+unsigned long sdk_state_generation(int device) {
+
+	struct sdk_state_slot *slot;
+	unsigned long generation;
+	unsigned int seq;
+
+	if (device < 0 || device >= MAX_NR_SDK) {
+		return 0;
+	}
+	slot = &m_slots[device];
+	do {
+		seq = slot->seq;
+		__sync_synchronize();
+		generation = slot->state.generation;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != slot->seq);
+	return generation;
+}
@@ -0,0 +1,130 @@
+#ifndef SDK_STATE_H_
+#define SDK_STATE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser_sdk.h"
+
+#define SDK_STATE_LINE		64	/* a slot fills exactly one cache line */
+
+/* sdk_state.flags */
+#define SDK_STATE_ONLINE	0x01	/* answering valid frames to command 0 */
+#define SDK_STATE_STALE		0x02	/* restored from the state file, not polled yet */
+
+#define SDK_NR_OPTICAL_RELAYS	4
+
+/*
+ * Everything known about one controller, published as a whole. Booleans are
+ * packed into bitmaps and values into the width the protocol gives them, so
+ * with its sequence counter a state fills a single cache line. Read it
+ * through the accessors below, the layout is free to change.
+ */
+struct sdk_state {
+	uint64_t updated;		/* CLOCK_MONOTONIC ms of the last publish */
+	uint32_t generation;		/* bumped by every publish */
+	uint32_t dry_contact;		/* bit n is contact n + 1 */
+	uint8_t hw;
+	uint8_t sw;
+	uint8_t self_temp;
+	uint8_t relay;
+	uint8_t optical_relay;		/* bit n is optical relay n + 1 */
+	uint8_t flags;
+	uint32_t reg[SDK_MAX_REGS];	/* named by sdk_table.reg_name */
+};
+
+/*
+ * One slot per controller. The poller thread is the only writer: seq is odd
+ * while it copies a new state in. Readers copy the state and retry if seq
+ * was odd or moved meanwhile, neither side ever blocks.
+ */
+struct sdk_state_slot {
+	volatile unsigned int seq;
+	struct sdk_state state;
+} __attribute__((aligned(SDK_STATE_LINE)));
+
+static inline int sdk_state_online(const struct sdk_state *s) {
+	return (s->flags & SDK_STATE_ONLINE) != 0;
+}
+
+static inline int sdk_state_stale(const struct sdk_state *s) {
+	return (s->flags & SDK_STATE_STALE) != 0;
+}
+
+static inline int sdk_state_dry(const struct sdk_state *s, int contact) {
+	return (s->dry_contact >> contact) & 1;
+}
+
+static inline uint32_t sdk_state_contacts(const struct sdk_state *s) {
+	return s->dry_contact;
+}
+
+static inline int sdk_state_optical(const struct sdk_state *s, int relay) {
+	return (s->optical_relay >> relay) & 1;
+}
+
+static inline unsigned int sdk_state_hw(const struct sdk_state *s) {
+	return s->hw;
+}
+
+static inline unsigned int sdk_state_sw(const struct sdk_state *s) {
+	return s->sw;
+}
+
+static inline unsigned int sdk_state_temp(const struct sdk_state *s) {
+	return s->self_temp;
+}
+
+static inline unsigned int sdk_state_relay(const struct sdk_state *s) {
+	return s->relay;
+}
+
+static inline unsigned long sdk_state_reg(const struct sdk_state *s, int reg) {
+	return s->reg[reg];
+}
+
+/* writer side, the poller thread's private copy only */
+static inline void sdk_state_set_online(struct sdk_state *s, int online) {
+	if (online) {
+		s->flags |= SDK_STATE_ONLINE;
+	} else {
+		s->flags &= ~SDK_STATE_ONLINE;
+	}
+}
+
+static inline void sdk_state_set_stale(struct sdk_state *s, int stale) {
+	if (stale) {
+		s->flags |= SDK_STATE_STALE;
+	} else {
+		s->flags &= ~SDK_STATE_STALE;
+	}
+}
+
+static inline void sdk_state_set_dry(struct sdk_state *s, int contact, int level) {
+	if (level) {
+		s->dry_contact |= 1U << contact;
+	} else {
+		s->dry_contact &= ~(1U << contact);
+	}
+}
+
+/* seqlock read side, shared with the readers of the exported slots */
+static inline void sdk_state_copy(const struct sdk_state_slot *slot,
+		struct sdk_state *state) {
+	unsigned int seq;
+
+	do {
+		seq = slot->seq;
+		__sync_synchronize();
+		memcpy(state, (const void *) &slot->state, sizeof (*state));
+		__sync_synchronize();
+	} while ((seq & 1) || seq != slot->seq);
+}
+
+void sdk_state_share(struct sdk_state_slot *);
+void sdk_state_publish(int, struct sdk_state *);
+int sdk_state_read(int, struct sdk_state *);
+unsigned long sdk_state_generation(int);
+
+#endif /*SDK_STATE_H_*/
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdk_table.h"
+
+/*
+ * Command table. One statement per line, '#' starts a comment:
+ *
+ *	command <name> <bytes> <answer_len> <priority> <period_min> <period_max>
+ *	field <command> <name> <offset> <width> <hex|dec|bits>
+ *
+ * "\r\n" is appended to the command bytes. answer_len is the shortest valid
+ * answer including its "\r\n", every field has to end before the terminator.
+ * Fields named hw, sw, temp, relay and dry fill the status values, any other
+ * name is a register, shown as get_regs over TCP.
+ */
+/* sdk.conf without its comments, sdk_conf.h is generated from it by make */
+static const char m_builtin[] = ""
+#include "sdk_conf.h"
+	;
+
+struct sdk_table sdk_table;
+
+/* status values a field can be stored in, and how many characters fit */
+static const struct {
+	const char *name;
+	int field;
+	int max_width;
+} m_known[] = {
+	{ "hw",    SDK_FIELD_HW,    2 },
+	{ "sw",    SDK_FIELD_SW,    2 },
+	{ "temp",  SDK_FIELD_TEMP,  2 },
+	{ "relay", SDK_FIELD_RELAY, 2 },
+	{ "dry",   SDK_FIELD_DRY,   SDK_NR_DRY_CONTACTS },
+};
+
+#define SDK_NR_KNOWN (sizeof(m_known) / sizeof(m_known[0]))
+
+static int table_error(const char *source, int lineno, const char *what) {
+
+	fprintf(stderr, "%s:%d: %s\n", source, lineno, what);
+	return (-1);
+}
+
+static struct sdk_command_def *table_command(struct sdk_table *t, const char *name) {
+
+	int i;
+
+	for (i = 0; i < t->nr_commands; i++) {
+		if (strcmp(t->command[i].name, name) == 0) {
+			return &t->command[i];
+		}
+	}
+	return NULL;
+}
+
+/* the status value or register a field name refers to, -1 if out of registers */
+static int table_field(struct sdk_table *t, const char *name, int *max_width) {
+
+	int i;
+
+	for (i = 0; i < SDK_NR_KNOWN; i++) {
+		if (strcmp(m_known[i].name, name) == 0) {
+			*max_width = m_known[i].max_width;
+			return m_known[i].field;
+		}
+	}
+	/* registers are 32 bits: 8 hex or 9 decimal digits */
+	*max_width = 9;
+	for (i = 0; i < t->nr_regs; i++) {
+		if (strcmp(t->reg_name[i], name) == 0) {
+			return SDK_FIELD_REG + i;
+		}
+	}
+	if (t->nr_regs >= SDK_MAX_REGS) {
+		return (-1);
+	}
+	snprintf(t->reg_name[t->nr_regs], SDK_NAME_SIZE, "%s", name);
+	return SDK_FIELD_REG + t->nr_regs++;
+}
+
+static int table_line(struct sdk_table *t, const char *line, const char *source,
+		int lineno) {
+
+	char kind[SDK_NAME_SIZE], name[SDK_NAME_SIZE], arg[SDK_MESSAGE_SIZE];
+	char decode[SDK_NAME_SIZE];
+	struct sdk_command_def *c;
+	struct sdk_field_def *f;
+	int offset, width, max_width, field;
+
+	line += strspn(line, " \t");
+	if (*line == '#' || *line == '\0' || *line == '\n' || *line == '\r') {
+		return 0;
+	}
+	if (sscanf(line, "%15s", kind) != 1) {
+		return 0;
+	}
+
+	if (strcmp(kind, "command") == 0) {
+		if (t->nr_commands >= SDK_MAX_COMMANDS) {
+			return table_error(source, lineno, "too many commands");
+		}
+		c = &t->command[t->nr_commands];
+		memset(c, 0, sizeof(*c));
+		if (sscanf(line, "%*s %15s %61s %d %d %d %d", c->name, arg, &c->answer_len,
+				&c->priority, &c->period_min, &c->period_max) != 6) {
+			return table_error(source, lineno,
+				"expected command <name> <bytes> <answer_len> <priority> <period_min> <period_max>");
+		}
+		if (table_command(t, c->name) != NULL) {
+			return table_error(source, lineno, "command defined twice");
+		}
+		if (c->period_min <= 0 || c->period_max < c->period_min) {
+			return table_error(source, lineno, "bad polling period");
+		}
+		c->len = snprintf(c->message, sizeof(c->message), "%s\r\n", arg);
+		t->nr_commands++;
+		return 0;
+	}
+
+	if (strcmp(kind, "field") == 0) {
+		if (sscanf(line, "%*s %15s %15s %d %d %15s", arg, name, &offset, &width,
+				decode) != 5) {
+			return table_error(source, lineno,
+				"expected field <command> <name> <offset> <width> <hex|dec|bits>");
+		}
+		c = table_command(t, arg);
+		if (c == NULL) {
+			return table_error(source, lineno, "field of an unknown command");
+		}
+		if (c->nr_fields >= SDK_MAX_CMD_FIELDS) {
+			return table_error(source, lineno, "too many fields");
+		}
+		field = table_field(t, name, &max_width);
+		if (field < 0) {
+			return table_error(source, lineno, "too many registers");
+		}
+		f = &c->field[c->nr_fields];
+		if (strcmp(decode, "hex") == 0) {
+			f->decode = SDK_DECODE_HEX;
+			if (max_width > 8) {
+				max_width = 8;
+			}
+		} else if (strcmp(decode, "dec") == 0) {
+			f->decode = SDK_DECODE_DEC;
+		} else if (strcmp(decode, "bits") == 0 && field == SDK_FIELD_DRY) {
+			f->decode = SDK_DECODE_BITS;
+		} else {
+			return table_error(source, lineno, "bad decode type for this field");
+		}
+		if (f->decode != SDK_DECODE_BITS && field == SDK_FIELD_DRY) {
+			return table_error(source, lineno, "dry contacts are decoded as bits");
+		}
+		if (width <= 0 || width > max_width) {
+			return table_error(source, lineno, "field too wide for its value");
+		}
+		if (offset < 0 || offset + width + 2 > c->answer_len) {
+			return table_error(source, lineno, "field ends past answer_len");
+		}
+		f->field = field;
+		f->offset = offset;
+		f->width = width;
+		c->nr_fields++;
+		return 0;
+	}
+
+	return table_error(source, lineno, "unknown statement");
+}
+
+/*
+ * The field a name refers to: a status value, "dry1" to "dry20" for single
+ * contacts, or a register of the loaded table. -1 if there is no such field.
+ */
+int sdk_table_lookup(const char *name) {
+
+	char *end;
+	long contact;
+	int i;
+
+	if (strncmp(name, "dry", 3) == 0 && name[3] != '\0') {
+		contact = strtol(name + 3, &end, 10);
+		if (*end != '\0' || contact < 1 || contact > SDK_NR_DRY_CONTACTS) {
+			return (-1);
+		}
+		return SDK_FIELD_DRY + contact - 1;
+	}
+	for (i = 0; i < SDK_NR_KNOWN; i++) {
+		if (m_known[i].field != SDK_FIELD_DRY && strcmp(m_known[i].name, name) == 0) {
+			return m_known[i].field;
+		}
+	}
+	for (i = 0; i < sdk_table.nr_regs; i++) {
+		if (strcmp(sdk_table.reg_name[i], name) == 0) {
+			return SDK_FIELD_REG + i;
+		}
+	}
+	return (-1);
+}
+
+/* the name sdk_table_lookup() knows a field by, empty for an unknown one */
+int sdk_table_name(int field, char *name, int size) {
+
+	int i;
+
+	if (field >= SDK_FIELD_DRY && field < SDK_FIELD_DRY + SDK_NR_DRY_CONTACTS) {
+		return snprintf(name, size, "dry%d", field - SDK_FIELD_DRY + 1);
+	}
+	if (field >= SDK_FIELD_REG && field < SDK_FIELD_REG + sdk_table.nr_regs) {
+		return snprintf(name, size, "%s", sdk_table.reg_name[field - SDK_FIELD_REG]);
+	}
+	for (i = 0; i < SDK_NR_KNOWN; i++) {
+		if (m_known[i].field == field) {
+			return snprintf(name, size, "%s", m_known[i].name);
+		}
+	}
+	return snprintf(name, size, "%s", "");
+}
+
+/*
+ * Compile the command table from filename, or the built-in one for NULL.
+ * sdk_table is only replaced by a table that loaded without errors.
+ */
+int sdk_table_load(const char *filename) {
+
+	static struct sdk_table t;
+	char line[256];
+	const char *p, *end;
+	FILE *fp;
+	int lineno = 0, error = 0;
+
+	memset(&t, 0, sizeof(t));
+	if (filename == NULL) {
+		for (p = m_builtin; *p != '\0'; p = end + 1) {
+			end = strchr(p, '\n');
+			snprintf(line, sizeof(line), "%.*s", (int)(end - p), p);
+			if (table_line(&t, line, "built-in", ++lineno) < 0) {
+				error = 1;
+			}
+		}
+	} else {
+		fp = fopen(filename, "r");
+		if (fp == NULL) {
+			perror(filename);
+			return (-1);
+		}
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			if (table_line(&t, line, filename, ++lineno) < 0) {
+				error = 1;
+			}
+		}
+		fclose(fp);
+	}
+	if (!error && t.nr_commands == 0) {
+		fprintf(stderr, "%s: no commands\n", filename ? filename : "built-in");
+		error = 1;
+	}
+	if (error) {
+		return (-1);
+	}
+	sdk_table = t;
+	return 0;
+}
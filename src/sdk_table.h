@@ -0,0 +1,56 @@
+#ifndef SDK_TABLE_H_
+#define SDK_TABLE_H_
+
+#include "parser_sdk.h"
+#include "sdk_sched.h"
+
+#define SDK_MAX_COMMANDS	SCHED_MAX_ENTRIES
+#define SDK_MAX_CMD_FIELDS	8
+#define SDK_NAME_SIZE		16
+#define SDK_MESSAGE_SIZE	64
+
+enum sdk_decode {
+	SDK_DECODE_HEX,		/* hex digits, most significant first */
+	SDK_DECODE_DEC,		/* decimal digits */
+	SDK_DECODE_BITS		/* '0'/'1' characters, the first one is bit 0 */
+};
+
+/* one field of an answer, width characters starting at offset */
+struct sdk_field_def {
+	int field;		/* enum sdk_field the value is stored in */
+	int offset;
+	int width;
+	int decode;
+};
+
+struct sdk_command_def {
+	char name[SDK_NAME_SIZE];
+	char message[SDK_MESSAGE_SIZE];	/* "\r\n" included */
+	int len;
+	int answer_len;		/* shortest valid answer, "\r\n" included */
+	int priority;
+	int period_min;
+	int period_max;
+	int nr_fields;
+	struct sdk_field_def field[SDK_MAX_CMD_FIELDS];
+};
+
+/*
+ * Poll set compiled from the command table. Command 0 is the liveness
+ * check: it is used to probe the baud rate and decides whether a
+ * controller is online.
+ */
+struct sdk_table {
+	int nr_commands;
+	struct sdk_command_def command[SDK_MAX_COMMANDS];
+	int nr_regs;
+	char reg_name[SDK_MAX_REGS][SDK_NAME_SIZE];
+};
+
+extern struct sdk_table sdk_table;
+
+int sdk_table_load(const char *);
+int sdk_table_lookup(const char *);
+int sdk_table_name(int, char *, int);
+
+#endif /*SDK_TABLE_H_*/
@@ -7,7 +7,13 @@
 #include <termios.h> /* POSIX terminal control definitions */
 #include <stdint.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 #include "log.h"
+#include "serial.h"
 
 typedef uint8_t BYTE;
 typedef uint16_t WORD;
@@ -38,74 +44,127 @@ int Stop_Bits = 1;
 int Parity = 0;
 int Format = 4;
 
-int open_serial_port(char device[], long baud_rate, int data_bits,
-		int stop_bits, int parity) {
-
-	int fd, error;
-	struct termios oldtio, newtio;
-	
-
-	error=0;
-	strcpy(devicename, device);
-
-	Baud_Rate=baud_rate;
-	Data_Bits=data_bits;
-	Stop_Bits=stop_bits;
-	Parity=parity;
-
-	switch (Baud_Rate) {
+/* termios speed for a baud rate, 0 if the rate is not supported */
+static speed_t serial_baud_flag(long baud_rate) {
+
+	switch (baud_rate) {
+#ifdef B921600
+	case 921600:
+		return B921600;
+#endif
+#ifdef B460800
+	case 460800:
+		return B460800;
+#endif
+#ifdef B230400
+	case 230400:
+		return B230400;
+#endif
 	case 115200:
-		BAUD = B115200;
-		break;
+		return B115200;
 	case 57600:
-	default:
-		BAUD = B57600;
-		break;
+		return B57600;
 	case 38400:
-		BAUD = B38400;
-		break;
+		return B38400;
 	case 19200:
-		BAUD = B19200;
-		break;
+		return B19200;
 	case 9600:
-		BAUD = B9600;
-		break;
+		return B9600;
 	case 4800:
-		BAUD = B4800;
-		break;
+		return B4800;
 	case 2400:
-		BAUD = B2400;
-		break;
+		return B2400;
 	case 1800:
-		BAUD = B1800;
-		break;
+		return B1800;
 	case 1200:
-		BAUD = B1200;
-		break;
+		return B1200;
 	case 600:
-		BAUD = B600;
-		break;
+		return B600;
 	case 300:
-		BAUD = B300;
-		break;
+		return B300;
 	case 200:
-		BAUD = B200;
-		break;
+		return B200;
 	case 150:
-		BAUD = B150;
-		break;
+		return B150;
 	case 134:
-		BAUD = B134;
-		break;
+		return B134;
 	case 110:
-		BAUD = B110;
-		break;
+		return B110;
 	case 75:
-		BAUD = B75;
-		break;
+		return B75;
 	case 50:
-		BAUD = B50;
-		break;
+		return B50;
+	}
+	return 0;
+}
+
+/*
+ * Ask the driver to hand received bytes up at once instead of batching them:
+ * ASYNC_LOW_LATENCY for UARTs, and the latency timer of FTDI style USB
+ * adapters, 16 ms by default, down to 1 ms. Ports without either (ptys,
+ * other adapters) are left alone.
+ */
+static void serial_low_latency(int fd, const char *device) {
+
+	char path[128];
+	const char *name;
+	int f;
+#ifdef TIOCSSERIAL
+	struct serial_struct ser;
+
+	if (ioctl(fd, TIOCGSERIAL, &ser) == 0) {
+		ser.flags |= ASYNC_LOW_LATENCY;
+		ioctl(fd, TIOCSSERIAL, &ser);
+	}
+#endif
+	name = strrchr(device, '/');
+	name = name ? name + 1 : device;
+	snprintf(path, sizeof (path), "/sys/bus/usb-serial/devices/%s/latency_timer", name);
+	f = open(path, O_WRONLY);
+	if (f >= 0) {
+		if (write(f, "1", 1) != 1 && DEBUG) {
+			write_log("Could not lower USB serial latency timer");
+		}
+		close(f);
+	}
+}
+
+/* switch an open port to another baud rate, dropping whatever is buffered */
+int serial_set_baud(int fd, long baud_rate) {
+
+	struct termios tio;
+	speed_t speed = serial_baud_flag(baud_rate);
+
+	if (speed == 0 || tcgetattr(fd, &tio) < 0) {
+		return (-1);
+	}
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	tcflush(fd, TCIOFLUSH);
+	if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+		return (-1);
+	}
+	return 0;
+}
+
+int open_serial_port(char device[], long baud_rate, int data_bits,
+		int stop_bits, int parity) {
+
+	int fd, error;
+	struct termios oldtio, newtio;
+	
+
+	error=0;
+	strcpy(devicename, device);
+
+	Baud_Rate=baud_rate;
+	Data_Bits=data_bits;
+	Stop_Bits=stop_bits;
+	Parity=parity;
+
+	BAUD = serial_baud_flag(Baud_Rate);
+	if (BAUD == 0) {
+		BAUD = B57600;
 	}
 
 	switch (Data_Bits) {
@@ -150,7 +209,7 @@ int open_serial_port(char device[], long baud_rate, int data_bits,
 		break;
 	}
 
-	fd = open(devicename, O_RDWR | O_NOCTTY | O_NDELAY);
+	fd = open(devicename, O_RDWR | O_NOCTTY | O_NONBLOCK);
 	if (fd < 0) {
 		perror(devicename);
 		return 0;
@@ -159,16 +218,19 @@ int open_serial_port(char device[], long baud_rate, int data_bits,
 	fcntl(fd, F_SETOWN, getpid());
 
 	tcgetattr(fd, &oldtio);
+	memset(&newtio, 0, sizeof(newtio));
 	newtio.c_cflag = BAUD | DATABITS | STOPBITS | PARITYON | PARITY | CLOCAL
 			| CREAD;
 	newtio.c_iflag = IGNPAR;
 	newtio.c_oflag = 0;
 	newtio.c_lflag = 0;
+	/* reads never block (O_NONBLOCK), frames are assembled in the ring */
 	newtio.c_cc[VMIN]=0;
 	newtio.c_cc[VTIME]=0;
 
 	tcflush(fd, TCIFLUSH);
 	tcsetattr(fd, TCSANOW, &newtio);
+	serial_low_latency(fd, devicename);
 	if (DEBUG) {
 		write_log("Serial Port /dev/ttyXXX is now open \n");
 	}
@@ -177,57 +239,451 @@ int open_serial_port(char device[], long baud_rate, int data_bits,
 
 }
 
-int request_port(char *message, int len_mes, char answer[256],
-		int file_descriptor) {
+void serial_ring_init(struct serial_ring *ring) {
+
+	ring->head = 0;
+	ring->scan = 0;
+	ring->tail = 0;
+	ring->discard = 0;
+	ring->dropped = 0;
+}
 
-	int n, res;
-	fd_set fs;
-	struct timeval tv;
+/* read() straight into the free part of the ring until the port runs dry */
+int serial_ring_fill(struct serial_ring *ring, int fd) {
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 150000;
+	unsigned int space, off;
+	int n, total = 0;
+
+	while ((space = SERIAL_RING_SIZE - (ring->tail - ring->head)) > 0) {
+		off = ring->tail & SERIAL_RING_MASK;
+		if (space > SERIAL_RING_SIZE - off) {
+			space = SERIAL_RING_SIZE - off;
+		}
+		n = read(fd, ring->data + off, space);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				break;
+			}
+			return (-1);
+		}
+		if (n == 0) {
+			/* VMIN=0/VTIME=0 ttys report "no data" as 0, hangups come as POLLHUP */
+			break;
+		}
+		ring->tail += n;
+		total += n;
+	}
+	return total;
+}
+
+/* position just past the first "\r\n" ending at or after from, 0 if none yet */
+static int serial_ring_find(struct serial_ring *ring, unsigned int from,
+		unsigned int *end) {
+
+	unsigned int off, n;
+	const char *p;
+
+	while (from != ring->tail) {
+		off = from & SERIAL_RING_MASK;
+		n = ring->tail - from;
+		if (n > SERIAL_RING_SIZE - off) {
+			n = SERIAL_RING_SIZE - off;
+		}
+		p = memchr(ring->data + off, '\n', n);
+		if (p == NULL) {
+			from += n;
+			continue;
+		}
+		from += p - (ring->data + off);
+		if (from != ring->head
+				&& ring->data[(from - 1) & SERIAL_RING_MASK] == '\r') {
+			*end = from + 1;
+			return 1;
+		}
+		from++;
+	}
+	return 0;
+}
+
+/*
+ * Frame extraction: a frame runs from the first byte that is not a line
+ * terminator to the next "\r\n". On success *frame points into the ring and
+ * stays valid until serial_ring_consume(); frames that grow to
+ * SERIAL_FRAME_SIZE are dropped up to their terminator.
+ */
+int serial_ring_frame(struct serial_ring *ring, const char **frame) {
+
+	unsigned int end, off, len;
+	char c;
+
+	for (;;) {
+		while (ring->head != ring->tail) {
+			c = ring->data[ring->head & SERIAL_RING_MASK];
+			if (c != '\r' && c != '\n') {
+				break;
+			}
+			if (c == '\n') {
+				/* the terminator of a frame that was being dropped */
+				ring->discard = 0;
+			}
+			ring->head++;
+			ring->scan = 0;
+		}
+		if (ring->head == ring->tail) {
+			return 0;
+		}
+
+		if (!serial_ring_find(ring, ring->head + ring->scan, &end)) {
+			ring->scan = ring->tail - ring->head;
+			if (ring->scan >= SERIAL_FRAME_SIZE) {
+				ring->dropped += ring->scan;
+				ring->head = ring->tail;
+				ring->scan = 0;
+				ring->discard = 1;
+			}
+			return 0;
+		}
+
+		len = end - ring->head;
+		ring->scan = 0;
+		if (ring->discard || len >= SERIAL_FRAME_SIZE) {
+			ring->dropped += len;
+			ring->head = end;
+			ring->discard = 0;
+			continue;
+		}
+
+		off = ring->head & SERIAL_RING_MASK;
+		if (off + len > SERIAL_RING_SIZE) {
+			memcpy(ring->data + SERIAL_RING_SIZE, ring->data,
+					off + len - SERIAL_RING_SIZE);
+		}
+		*frame = ring->data + off;
+		return len;
+	}
+}
 
+void serial_ring_consume(struct serial_ring *ring, int len) {
+
+	ring->head += len;
+	ring->scan = 0;
+}
+
+/* deadline for an exchange of this many bytes, wire time at baud_rate included */
+int serial_deadline_ms(long baud_rate, int bytes) {
+
+	if (baud_rate <= 0) {
+		return SERIAL_TIMEOUT_MS;
+	}
+	/* 8N1: ten bits on the wire per byte */
+	return SERIAL_TIMEOUT_MS + (bytes * 10000L + baud_rate - 1) / baud_rate;
+}
+
+long serial_now_ms(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * Send one command and wait for its "\r\n" terminated answer. Bytes are
+ * consumed as soon as they arrive and the call returns as soon as the frame
+ * is complete, or -1 once timeout_ms has passed without a full frame.
+ */
+int request_port_timeout(char *message, int len_mes, char *answer,
+		int file_descriptor, int timeout_ms) {
+
+	struct serial_ring ring;
+	struct pollfd pfd;
+	const char *frame;
+	long deadline, left;
 	int fd = file_descriptor;
+	int n, len;
 
-	printf("len_mes = %d\n", len_mes);
+	/* drop whatever is left over from a previous, timed out transaction */
+	tcflush(fd, TCIFLUSH);
 
-	n = write(fd, message, len_mes-1);
-	if (n < 0) {
+	n = write(fd, message, len_mes - 1);
+	if (n != len_mes - 1) {
 		if (DEBUG) {
 			write_log("write() serial of failed!\n");
 		}
+		return (-1);
+	}
+
+	serial_ring_init(&ring);
+	deadline = serial_now_ms() + timeout_ms;
 
-	} 
+	pfd.fd = fd;
+	pfd.events = POLLIN;
 
-	FD_ZERO(&fs);
-	FD_SET(fd, &fs);
+	while ((left = deadline - serial_now_ms()) > 0) {
+		n = poll(&pfd, 1, left);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+		if (n == 0) {
+			break;
+		}
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			return (-1);
+		}
+		if (serial_ring_fill(&ring, fd) < 0) {
+			return (-1);
+		}
 
-	char buffer[55];
+		len = serial_ring_frame(&ring, &frame);
+		if (len > 0) {
+			/* callers of this interface own a plain SERIAL_FRAME_SIZE buffer */
+			memcpy(answer, frame, len);
+			answer[len] = '\0';
+			return len;
+		}
+	}
 
-	if (select(fd+1, &fs, NULL, NULL, &tv) < 0) {
-		printf("Timeout for wait read fd");
+	if (DEBUG) {
+		write_log("Timeout waiting for SDK answer");
+	}
+	return (-1);
+}
+
+int request_port(char *message, int len_mes, char *answer,
+		int file_descriptor) {
+
+	return request_port_timeout(message, len_mes, answer, file_descriptor,
+			SERIAL_TIMEOUT_MS);
+}
+
+/*
+ * Command queue. Requests are written in submission order while fewer than
+ * max_inflight are outstanding, and every answer frame is handed to the oldest
+ * in-flight request whose command head it echoes. The queue never blocks, so
+ * it can be driven from any poll()/epoll() loop via send/read/expire.
+ */
+void serial_queue_init(struct serial_queue *q, int fd, int max_inflight,
+		serial_cb callback, void *arg) {
+
+	memset(q, 0, sizeof(*q));
+	q->fd = fd;
+	q->max_inflight = max_inflight > 0 ? max_inflight : 1;
+	q->callback = callback;
+	q->arg = arg;
+	serial_ring_init(&q->ring);
+}
+
+int serial_queue_push(struct serial_queue *q, const char *message, int len,
+		int tag, int timeout_ms) {
+
+	struct serial_request *req;
+	int i;
+
+	if (len <= 0 || len > SERIAL_FRAME_SIZE) {
 		return (-1);
-	};
+	}
+	for (i = 0; i < SERIAL_QUEUE_SIZE; i++) {
+		req = &q->req[i];
+		if (req->state == REQ_FREE) {
+			memcpy(req->message, message, len);
+			req->len = len;
+			req->tag = tag;
+			req->timeout_ms = timeout_ms;
+			req->seq = q->seq++;
+			req->state = REQ_PENDING;
+			q->depth++;
+			return i;
+		}
+	}
+	return (-1);
+}
+
+static void serial_queue_complete(struct serial_queue *q,
+		struct serial_request *req, const char *frame, int len) {
+
+	int tag = req->tag;
+
+	q->sent_time = req->sent;
+	if (req->state == REQ_INFLIGHT) {
+		q->inflight--;
+	}
+	req->state = REQ_FREE;
+	q->depth--;
+	if (q->callback) {
+		q->callback(q->arg, tag, frame, len);
+	}
+}
+
+static struct serial_request *serial_queue_oldest(struct serial_queue *q,
+		enum serial_req_state state, const char *frame, int len) {
 
-	if (FD_ISSET(fd, &fs)) {
+	struct serial_request *req, *best = NULL;
+	int i, n;
 
-		usleep(150000);
-		res = read(fd, &buffer, 56);
-		printf("receiver: %d byte \n", res);
+	for (i = 0; i < SERIAL_QUEUE_SIZE; i++) {
+		req = &q->req[i];
+		if (req->state != state) {
+			continue;
+		}
+		if (frame) {
+			n = req->len < SERIAL_MATCH_LEN ? req->len : SERIAL_MATCH_LEN;
+			if (len < n || memcmp(frame, req->message, n) != 0) {
+				continue;
+			}
+		}
+		if (best == NULL || (long)(req->seq - best->seq) < 0) {
+			best = req;
+		}
+	}
+	return best;
+}
+
+int serial_queue_send(struct serial_queue *q) {
+
+	struct serial_request *req;
+	int n, sent = 0;
+
+	while (q->inflight < q->max_inflight) {
+		req = serial_queue_oldest(q, REQ_PENDING, NULL, 0);
+		if (req == NULL) {
+			break;
+		}
+		n = write(q->fd, req->message, req->len);
+		if (n < 0 && errno == EAGAIN) {
+			break;
+		}
+		if (n != req->len) {
+			if (DEBUG) {
+				write_log("write() serial of failed!\n");
+			}
+			serial_queue_complete(q, req, NULL, -1);
+			continue;
+		}
+		req->state = REQ_INFLIGHT;
+		clock_gettime(CLOCK_MONOTONIC, &req->sent);
+		req->deadline = serial_now_ms() + req->timeout_ms;
+		q->inflight++;
+		sent++;
+	}
+	return sent;
+}
+
+int serial_queue_read(struct serial_queue *q) {
+
+	struct serial_request *req;
+	struct timespec now;
+	const char *frame;
+	int len, full, empty, n, frames = 0;
 
-		if (res <= 0) {
-			printf("read result < 0");
+	now = q->rx_start;
+	do {
+		empty = (q->ring.tail == q->ring.head);
+		n = serial_ring_fill(&q->ring, q->fd);
+		if (n < 0) {
 			return (-1);
-		} else if (!res) {
-			close(fd);
-			FD_ZERO(&fs);
-		} else {
+		}
+		if (n > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (empty) {
+				q->rx_start = now;
+			}
+		}
+		full = (q->ring.tail - q->ring.head == SERIAL_RING_SIZE);
+		while ((len = serial_ring_frame(&q->ring, &frame)) > 0) {
+			frames++;
+			q->rx_time = q->rx_start;
+			req = serial_queue_oldest(q, REQ_INFLIGHT, frame, len);
+			if (req == NULL) {
+				q->unmatched++;
+			} else {
+				serial_queue_complete(q, req, frame, len);
+			}
+			serial_ring_consume(&q->ring, len);
+			/* whatever follows came in with the last read */
+			q->rx_start = now;
+		}
+		/* the ring filled up before the port ran dry, go back for the rest */
+	} while (full);
+	return frames;
+}
+
+int serial_queue_expire(struct serial_queue *q, long now) {
 
-			memset(answer, 0x00, res);
-			memcpy(answer, buffer, res);
-			return res;
-		};
+	struct serial_request *req;
+	int i, expired = 0;
 
-	};
+	for (i = 0; i < SERIAL_QUEUE_SIZE; i++) {
+		req = &q->req[i];
+		if (req->state == REQ_INFLIGHT && now - req->deadline >= 0) {
+			serial_queue_complete(q, req, NULL, -1);
+			expired++;
+		}
+	}
+	return expired;
 }
 
+/* milliseconds until the nearest in-flight deadline, -1 if nothing is in flight */
+int serial_queue_timeout(struct serial_queue *q, long now) {
+
+	long left, best = -1;
+	int i;
+
+	for (i = 0; i < SERIAL_QUEUE_SIZE; i++) {
+		if (q->req[i].state != REQ_INFLIGHT) {
+			continue;
+		}
+		left = q->req[i].deadline - now;
+		if (left < 0) {
+			left = 0;
+		}
+		if (best < 0 || left < best) {
+			best = left;
+		}
+	}
+	return best;
+}
+
+/* drive the queue on its own until every queued request has completed */
+int serial_queue_flush(struct serial_queue *q) {
+
+	struct pollfd pfd;
+	int timeout;
+
+	pfd.fd = q->fd;
+	pfd.events = POLLIN;
+
+	while (q->depth > 0) {
+		serial_queue_send(q);
+		timeout = serial_queue_timeout(q, serial_now_ms());
+		if (timeout < 0) {
+			/* pending requests but nothing in flight: port not writable */
+			timeout = SERIAL_TIMEOUT_MS;
+		}
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			return (-1);
+		}
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			return (-1);
+		}
+		if (pfd.revents & POLLIN) {
+			if (serial_queue_read(q) < 0) {
+				return (-1);
+			}
+		}
+		serial_queue_expire(q, serial_now_ms());
+	}
+	return 0;
+}
+
+int serial_queue_depth(struct serial_queue *q) {
+
+	return q->depth;
+}
+
+int serial_queue_inflight(struct serial_queue *q) {
+
+	return q->inflight;
+}
@@ -1,8 +1,93 @@
 #ifndef SERIAL_H_
 #define SERIAL_H_
 
+#include <time.h>
+
+/* frames from the controller are shorter than this, terminator included */
+#define SERIAL_FRAME_SIZE	256
+/* deadline for one command/answer transaction, on top of the wire time */
+#define SERIAL_TIMEOUT_MS	100
+
+/* per-port receive ring, a power of two well above one burst of answers */
+#define SERIAL_RING_SIZE	1024
+#define SERIAL_RING_MASK	(SERIAL_RING_SIZE - 1)
+
+/*
+ * read() fills the ring in place and frames are handed out as views into it.
+ * The SERIAL_FRAME_SIZE bytes past the end mirror the start of the ring, so a
+ * frame that wraps around is still contiguous.
+ */
+struct serial_ring {
+	unsigned int head;
+	unsigned int scan;
+	unsigned int tail;
+	int discard;
+	unsigned long dropped;
+	char data[SERIAL_RING_SIZE + SERIAL_FRAME_SIZE];
+};
+
+/* requests that may be queued on one port, pending and in flight */
+#define SERIAL_QUEUE_SIZE	16
+/* answers echo the head of their command, "TSC101..." for "TSC10173" */
+#define SERIAL_MATCH_LEN	6
+
+enum serial_req_state {
+	REQ_FREE,
+	REQ_PENDING,
+	REQ_INFLIGHT
+};
+
+/* called with the answer frame, or with frame == NULL and len == -1 on timeout */
+typedef void (*serial_cb)(void *arg, int tag, const char *frame, int len);
+
+struct serial_request {
+	enum serial_req_state state;
+	unsigned long seq;
+	char message[SERIAL_FRAME_SIZE];
+	int len;
+	int tag;
+	int timeout_ms;
+	long deadline;
+	struct timespec sent;
+};
+
+struct serial_queue {
+	int fd;
+	int max_inflight;
+	int depth;
+	int inflight;
+	unsigned long seq;
+	unsigned long unmatched;
+	serial_cb callback;
+	void *arg;
+	/* CLOCK_MONOTONIC times of the answer being delivered, valid in the callback */
+	struct timespec sent_time;	/* command written */
+	struct timespec rx_time;	/* first byte of the answer read */
+	struct timespec rx_start;	/* first byte of the frame in the ring */
+	struct serial_ring ring;
+	struct serial_request req[SERIAL_QUEUE_SIZE];
+};
+
 int open_serial_port(char *, long, int, int, int );
+int serial_set_baud(int, long);
 int request_port(char *, int, char *, int);
+int request_port_timeout(char *, int, char *, int, int);
+
+void serial_ring_init(struct serial_ring *);
+int serial_ring_fill(struct serial_ring *, int);
+int serial_ring_frame(struct serial_ring *, const char **);
+void serial_ring_consume(struct serial_ring *, int);
+int serial_deadline_ms(long, int);
+long serial_now_ms(void);
 
+void serial_queue_init(struct serial_queue *, int, int, serial_cb, void *);
+int serial_queue_push(struct serial_queue *, const char *, int, int, int);
+int serial_queue_send(struct serial_queue *);
+int serial_queue_read(struct serial_queue *);
+int serial_queue_expire(struct serial_queue *, long);
+int serial_queue_timeout(struct serial_queue *, long);
+int serial_queue_flush(struct serial_queue *);
+int serial_queue_depth(struct serial_queue *);
+int serial_queue_inflight(struct serial_queue *);
 
 #endif /*SERIAL_H_*/
@@ -6,16 +6,27 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 #include "parser_sdk.h"
+#include "sdk_edge.h"
+#include "sdk_table.h"
+#include "sdk_state.h"
+#include "sdk_history.h"
+#include "sdk_record.h"
+#include "server.h"
+#include "log.h"
 
-#define NTHREADS 50
-#define QUEUE_SIZE 5
 #define BUFFER_SIZE 256
 #define PORT "32001"
 
@@ -26,91 +37,1080 @@
 #define DRY 	"get_dry"
 #define OPTICAL	"get_optical"
 #define ALL		"get_all"
+#define EDGES	"get_edges"
+#define REGS	"get_regs"
+#define HISTORY	"get_history"
+#define STALE	"get_stale"
+#define QUIT	"quit"
+#define SUBSCRIBE	"subscribe"
+#define UNSUBSCRIBE	"unsubscribe"
 
-struct sdk_param external_sdk_53;
+/* one line per recorded edge: contact, level, after and before in seconds */
+#define EDGE_LINE_SIZE	48
 
-pthread_t threadid[NTHREADS];
-pthread_mutex_t lock;
-int counter = 0;
+/* one line per sample: time in seconds and value */
+#define SAMPLE_LINE_SIZE	32
 
-void *threadworker(void *arg) {
+/*
+ * A request split up: the command word, "@n" for controller n (the first
+ * one, 0, by default) and up to SERVER_MAX_ARGS positional arguments.
+ * Answers longer than SERVER_OUT_SIZE are rendered in chunks: the handler
+ * sets more and a cursor to continue from once the chunk has been sent.
+ */
+#define SERVER_MAX_ARGS	2
+#define SERVER_ARG_SIZE	64
+
+struct server_args {
+	int device;
+	int nr_args;
+	char arg[SERVER_MAX_ARGS][SERVER_ARG_SIZE];
+	unsigned long cursor;
+	int more;
+};
+
+/*
+ * All connections are served by SERVER_MAX_THREADS event loops at most,
+ * from a pool sized at start-up (-m). Every connection owns an answer
+ * buffer of SERVER_OUT_SIZE for a chunk, nothing is allocated per
+ * request. A connection that has not sent a complete request
+ * SERVER_FIRST_MS after it was accepted is closed, so idle clients can
+ * not hold the pool.
+ *
+ * A first read without a newline is a legacy request: it is answered as
+ * is and the connection closed. Otherwise the connection is a session:
+ * every line is a request, answered in order, each answer followed by an
+ * empty line. Pipelined requests are answered from the one read buffer
+ * until SERVER_PIPE_SIZE bytes of answers wait to be sent, the rest is
+ * read once the client has taken them. "quit" ends a session, and so does
+ * SERVER_IDLE_MS without a byte read or sent, unless it is subscribed.
+ */
+#define SERVER_FIRST_MS		5000
+#define SERVER_IDLE_MS		60000
+#define SERVER_OUT_SIZE		2048
+#define SERVER_PIPE_SIZE	4096
+#define SERVER_MAX_EVENTS	16
+
+struct server_conn {
+	int fd;			/* -1 for a free slot */
+	int session;		/* newline framed, kept open */
+	int closing;		/* close once the answers are out */
+	const struct server_command *stream;	/* answer still being rendered */
+	struct server_args stream_args;
+	char stream_last;	/* last byte of the streamed answer so far */
+	long deadline;		/* server_now_ms() it is closed at, 0 for never */
+	int subscribed;		/* changes of sub_mask on sub_device are pushed */
+	int sub_device;
+	uint32_t sub_mask;	/* bit n is enum sdk_field n */
+	long heartbeat;		/* ms without a push before a heartbeat, 0 for none */
+	long next_heartbeat;
+	unsigned long lost;	/* pushes that found no room, reported once there is */
+	uint32_t events;	/* what epoll waits for */
+	int in_len;
+	int out_len;
+	int out_sent;
+	char in[BUFFER_SIZE];
+	char out[SERVER_PIPE_SIZE + SERVER_OUT_SIZE];
+};
+
+struct server_command;
+
+/*
+ * Answers that only depend on a controller's state are rendered once per
+ * state generation and kept per loop, so no locking is needed. A request
+ * for them is a lookup, and usually a writev() straight from the cache.
+ */
+#define SERVER_CACHE_SIZE	BUFFER_SIZE
+
+struct server_cache {
+	int valid;
+	unsigned long generation;
+	int len;
+	char data[SERVER_CACHE_SIZE];
+};
+
+struct server_loop {
+	int epfd;
+	int listen_fd;
+	int listening;		/* listen_fd is in the epoll set */
+	int nr_conns;
+	int nr_free;
+	struct server_conn *conn;
+	struct server_cache *cache;	/* per controller, per command */
+	int feed_fd;			/* eventfd, signalled for every new delta */
+	unsigned long feed_next;	/* next delta of the feed to push */
+};
+
+/*
+ * "subscribe <fields> [heartbeat]" turns a session into a push channel:
+ * every change of one of the fields (a comma separated list, "dry" for all
+ * contacts or "all") is sent as "* <field> <value> <time>", and with a
+ * heartbeat in seconds "* heartbeat <generation>" when nothing was pushed
+ * for that long. Pushes start with "* " so they can not be taken for an
+ * answer. The poller copies every delta into the feed ring and wakes the
+ * loops through their eventfd, but only while somebody is subscribed.
+ */
+#define SERVER_FEED_SIZE	64	/* deltas, a power of two */
+#define SERVER_FEED_MASK	(SERVER_FEED_SIZE - 1)
+#define SERVER_PUSH_LINE	64	/* longest push record */
+
+static struct sdk_delta m_feed[SERVER_FEED_SIZE];
+static volatile unsigned long m_feed_head = 0;	/* deltas ever written */
+static volatile int m_subscribers = 0;
+static int m_nr_loops = 1;
+
+static struct server_conn *m_conns;
+static struct server_loop m_loops[SERVER_MAX_THREADS];
+
+/* renders the answer to a command into out, returns its length */
+typedef int (*server_handler)(const struct sdk_state *, struct server_args *,
+		char *, int);
+
+static int answer_hw(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	return snprintf(out, size, "%u", sdk_state_hw(st));
+}
+
+static int answer_sw(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	return snprintf(out, size, "%u", sdk_state_sw(st));
+}
+
+static int answer_temp(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	return snprintf(out, size, "%u", sdk_state_temp(st));
+}
+
+static int answer_relay(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	return snprintf(out, size, "%u", sdk_state_relay(st));
+}
+
+static int answer_stale(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	return snprintf(out, size, "%d", sdk_state_stale(st));
+}
+
+static int answer_optical(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	int i;
+
+	for (i = 0; i < SDK_NR_OPTICAL_RELAYS; i++) {
+		out[i] = '0' + sdk_state_optical(st, i);
+	}
+	return i;
+}
+
+static int answer_dry(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	int i;
+
+	for (i = 0; i < SDK_NR_DRY_CONTACTS; i++) {
+		out[i] = '0' + sdk_state_dry(st, i);
+	}
+	return i;
+}
+
+static int answer_regs(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	int i, len = 0;
+
+	for (i = 0; i < sdk_table.nr_regs && len < size; i++) {
+		len += snprintf(out + len, size - len, "%s=%lu\n",
+				sdk_table.reg_name[i], sdk_state_reg(st, i));
+	}
+	return len;
+}
+
+/* a chunk always has room for every edge of a contact */
+typedef char server_edges_fit[SERVER_OUT_SIZE - 2 >= SDK_EDGE_RING_SIZE * EDGE_LINE_SIZE
+		? 1 : -1];
+
+/*
+ * get_edges: the edges kept for every contact, oldest first per contact,
+ * as many contacts per chunk as fit. The cursor is the next contact.
+ */
+static int answer_edges(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	struct sdk_edge edges[SDK_EDGE_RING_SIZE];
+	int contact, n, i, len = 0;
+
+	for (contact = args->cursor; contact < SDK_NR_DRY_CONTACTS
+			&& size - len >= SDK_EDGE_RING_SIZE * EDGE_LINE_SIZE; contact++) {
+		n = sdk_edge_read(args->device, contact, 0, edges, SDK_EDGE_RING_SIZE, NULL);
+		for (i = 0; i < n && size - len > EDGE_LINE_SIZE; i++) {
+			len += snprintf(out + len, size - len, "%d %d %ld.%09ld %ld.%09ld\n",
+					contact + 1, edges[i].level,
+					(long) edges[i].after.tv_sec, edges[i].after.tv_nsec,
+					(long) edges[i].before.tv_sec, edges[i].before.tv_nsec);
+		}
+	}
+	args->cursor = contact;
+	args->more = contact < SDK_NR_DRY_CONTACTS;
+	return len;
+}
+
+/*
+ * "get_history <field> [seconds]": the samples of a field, from the value it
+ * had seconds ago, or all that are kept. Empty for an unknown field. The
+ * cursor is the number of the next sample, seconds only place the first.
+ */
+static int answer_history(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	struct sdk_sample samples[SERVER_OUT_SIZE / SAMPLE_LINE_SIZE];
+	struct timespec since;
+	int field, seconds = -1, max, n, i, len = 0;
+
+	if (args->nr_args < 1) {
+		return 0;
+	}
+	field = sdk_table_lookup(args->arg[0]);
+	if (field < 0 || sdk_history_depth() == 0) {
+		return 0;
+	}
+	if (args->nr_args > 1) {
+		seconds = atoi(args->arg[1]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &since);
+	since.tv_sec -= seconds;
+
+	max = size / SAMPLE_LINE_SIZE;
+	if (max > sizeof (samples) / sizeof (samples[0])) {
+		max = sizeof (samples) / sizeof (samples[0]);
+	}
+	n = sdk_history_read(args->device, field,
+			seconds >= 0 && args->cursor == 0 ? &since : NULL, args->cursor,
+			samples, max, &args->cursor);
+	args->more = (n == max);
+	for (i = 0; i < n; i++) {
+		len += snprintf(out + len, SAMPLE_LINE_SIZE + 1, "%ld.%09ld %lu\n",
+				(long) samples[i].time.tv_sec, samples[i].time.tv_nsec,
+				(unsigned long) samples[i].value);
+	}
+	return len;
+}
+
+/* get_all: the whole state as one struct sdk_record, see sdk_record.h */
+static int answer_all(const struct sdk_state *st, struct server_args *args,
+		char *out, int size) {
+
+	struct sdk_record rec;
+
+	if (size < sizeof (rec)) {
+		return 0;
+	}
+	sdk_record_fill(&rec, args->device, st);
+	memcpy(out, &rec, sizeof (rec));
+	return sizeof (rec);
+}
+
+/*
+ * Acts on the session itself rather than answering from the state. Returns
+ * the length of the answer, or -1 for none at all, not even the tail.
+ */
+typedef int (*server_session_handler)(struct server_conn *, struct server_args *,
+		char *, int);
+
+static int session_quit(struct server_conn *, struct server_args *, char *, int);
+static int session_subscribe(struct server_conn *, struct server_args *, char *, int);
+static int session_unsubscribe(struct server_conn *, struct server_args *, char *, int);
+
+/* server_command.flags */
+#define SERVER_CACHED	0x01	/* answer depends on the state alone */
+#define SERVER_BINARY	0x02	/* fixed size, always followed by "\n\n" in a session */
+#define SERVER_SESSION	0x04	/* sessions only, echoed like an unknown request otherwise */
+
+/*
+ * Command registry. Names are hashed on their length and two bytes into
+ * chained buckets at start-up, a request costs one hash and one compare
+ * however many commands there are.
+ */
+struct server_command {
+	const char *name;
+	server_handler handler;
+	int flags;
+	server_session_handler session;	/* instead of handler for SERVER_SESSION */
+	int len;		/* of name */
+	int next;		/* next command in the bucket, -1 ends the chain */
+};
+
+static struct server_command m_commands[] = {
+	{ HW,		answer_hw,	SERVER_CACHED },
+	{ SW,		answer_sw,	SERVER_CACHED },
+	{ TEMP,		answer_temp,	SERVER_CACHED },
+	{ RELAY,	answer_relay,	SERVER_CACHED },
+	{ DRY,		answer_dry,	SERVER_CACHED },
+	{ OPTICAL,	answer_optical,	SERVER_CACHED },
+	{ REGS,		answer_regs,	SERVER_CACHED },
+	{ EDGES,	answer_edges,	0 },
+	{ HISTORY,	answer_history,	0 },
+	{ STALE,	answer_stale,	SERVER_CACHED },
+	{ ALL,		answer_all,	SERVER_CACHED | SERVER_BINARY },
+	{ QUIT,		NULL,		SERVER_SESSION,	session_quit },
+	{ SUBSCRIBE,	NULL,		SERVER_SESSION,	session_subscribe },
+	{ UNSUBSCRIBE,	NULL,		SERVER_SESSION,	session_unsubscribe },
+};
+
+#define SERVER_NR_COMMANDS	(sizeof(m_commands) / sizeof(m_commands[0]))
+#define SERVER_BUCKETS		32	/* a power of two */
+
+static int m_buckets[SERVER_BUCKETS];
+
+/* most commands share "get_", the byte after it and the last one differ */
+static unsigned int server_bucket(const char *name, int len) {
+
+	unsigned int hash = len;
+
+	hash = hash * 31 + (unsigned char) name[len > 4 ? 4 : 0];
+	hash = hash * 31 + (unsigned char) name[len - 1];
+	return hash & (SERVER_BUCKETS - 1);
+}
+
+static void server_commands_init(void) {
+
+	unsigned int bucket;
+	int i;
+
+	for (i = 0; i < SERVER_BUCKETS; i++) {
+		m_buckets[i] = -1;
+	}
+	for (i = 0; i < SERVER_NR_COMMANDS; i++) {
+		m_commands[i].len = strlen(m_commands[i].name);
+		bucket = server_bucket(m_commands[i].name, m_commands[i].len);
+		m_commands[i].next = m_buckets[bucket];
+		m_buckets[bucket] = i;
+	}
+}
+
+static const struct server_command *server_lookup(const char *name, int len) {
+
+	const struct server_command *c;
+	int i;
+
+	if (len == 0) {
+		return NULL;
+	}
+	for (i = m_buckets[server_bucket(name, len)]; i >= 0; i = c->next) {
+		c = &m_commands[i];
+		if (c->len == len && memcmp(c->name, name, len) == 0) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/* split the arguments after the command word, -1 for too many or too long */
+static int server_parse(const char *p, struct server_args *args) {
+
+	int len;
+
+	args->device = 0;
+	args->nr_args = 0;
+	args->cursor = 0;
+	args->more = 0;
+	while (1) {
+		p += strspn(p, " \t");
+		len = strcspn(p, " \t");
+		if (len == 0) {
+			return 0;
+		}
+		if (*p == '@') {
+			args->device = atoi(p + 1);
+		} else if (args->nr_args < SERVER_MAX_ARGS && len < SERVER_ARG_SIZE) {
+			memcpy(args->arg[args->nr_args], p, len);
+			args->arg[args->nr_args][len] = '\0';
+			args->nr_args++;
+		} else {
+			return (-1);
+		}
+		p += len;
+	}
+}
+
+/* snprintf counts what did not fit */
+static int server_clamp(int len, int size) {
+
+	return len < size ? len : size - 1;
+}
+
+/*
+ * The answer to request: rendered into out, or found in the loop's cache.
+ * *answer is set to where it is, *binary if it is not text, the length is
+ * returned, -1 for no answer at all. An answer that did not fit is left in
+ * conn->stream.
+ */
+static int server_answer(struct server_loop *loop, struct server_conn *conn,
+		const char *request, char *out, int size, const char **answer, int *binary) {
+
+	const struct server_command *c;
+	struct server_cache *e;
+	struct server_args args;
+	struct sdk_state st;
+	int len;
+
+	*answer = out;
+	*binary = 0;
+	len = strcspn(request, " \t");
+	c = server_lookup(request, len);
+	if (c == NULL || ((c->flags & SERVER_SESSION) && !conn->session)) {
+		/* unknown requests are echoed, as they always were */
+		return server_clamp(snprintf(out, size, "%s", request), size);
+	}
+	if (server_parse(request + len, &args) < 0 || args.device < 0
+			|| args.device >= sdk_device_list_length) {
+		return 0;
+	}
+	if (c->flags & SERVER_SESSION) {
+		return c->session(conn, &args, out, size);
+	}
+	*binary = (c->flags & SERVER_BINARY) != 0;
+	if (!(c->flags & SERVER_CACHED) || args.nr_args > 0) {
+		/* one consistent snapshot per request */
+		sdk_state_read(args.device, &st);
+		len = server_clamp(c->handler(&st, &args, out, size), size);
+		if (args.more) {
+			conn->stream = c;
+			conn->stream_args = args;
+		}
+		return len;
+	}
+
+	e = &loop->cache[args.device * SERVER_NR_COMMANDS + (c - m_commands)];
+	if (!e->valid || e->generation != sdk_state_generation(args.device)) {
+		sdk_state_read(args.device, &st);
+		e->len = server_clamp(c->handler(&st, &args, e->data, SERVER_CACHE_SIZE),
+				SERVER_CACHE_SIZE);
+		e->generation = st.generation;
+		e->valid = 1;
+	}
+	*answer = e->data;
+	return e->len;
+}
+
+static long server_now_ms(void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* traffic on a session, which lives until it has been idle too long */
+static void server_touch(struct server_conn *conn) {
+
+	if (conn->session) {
+		conn->deadline = conn->subscribed ? 0 : server_now_ms() + SERVER_IDLE_MS;
+	}
+}
+
+static void server_unsubscribe(struct server_conn *conn) {
+
+	if (conn->subscribed) {
+		conn->subscribed = 0;
+		__sync_fetch_and_sub(&m_subscribers, 1);
+	}
+}
+
+/* a loop only listens while it has a free slot, the others accept meanwhile */
+static void server_listen(struct server_loop *loop, int listen) {
+
+	struct epoll_event ev;
+
+	if (loop->listening == listen) {
+		return;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(loop->epfd, listen ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, loop->listen_fd, &ev);
+	loop->listening = listen;
+}
+
+static void server_close(struct server_loop *loop, struct server_conn *conn) {
+
+	server_unsubscribe(conn);
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn->fd = -1;
+	conn->stream = NULL;
+	loop->nr_free++;
+	server_listen(loop, 1);
+}
+
+/* send what the socket takes, -1 on error, 1 once everything is out */
+static int server_flush(struct server_conn *conn) {
+
+	int n;
+
+	while (conn->out_sent < conn->out_len) {
+		n = send(conn->fd, conn->out + conn->out_sent,
+				conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			return (-1);
+		}
+		conn->out_sent += n;
+		server_touch(conn);
+	}
+	return 1;
+}
+
+static void server_watch(struct server_loop *loop, struct server_conn *conn,
+		uint32_t events) {
+
+	struct epoll_event ev;
+
+	if (conn->events == events) {
+		return;
+	}
+	ev.events = events;
+	ev.data.ptr = conn;
+	epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->events = events;
+}
 
-	int sockfd, rw;
-	char *buffer;
-	sockfd = (int) arg;
+static void server_accept(struct server_loop *loop) {
 
-	buffer = malloc(BUFFER_SIZE);
-	bzero(buffer, BUFFER_SIZE);
+	struct epoll_event ev;
+	struct server_conn *conn;
+	int fd, i;
 
-	rw = read(sockfd, buffer, BUFFER_SIZE);
-	if (rw < 0) {
-		perror("Error reading form socket, exiting thread");
-		pthread_exit(0);
+	while (loop->nr_free > 0 && (fd = accept(loop->listen_fd, NULL, NULL)) >= 0) {
+		conn = NULL;
+		for (i = 0; i < loop->nr_conns; i++) {
+			if (loop->conn[i].fd < 0) {
+				conn = &loop->conn[i];
+				break;
+			}
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		conn->fd = fd;
+		conn->session = 0;
+		conn->closing = 0;
+		conn->deadline = server_now_ms() + SERVER_FIRST_MS;
+		conn->subscribed = 0;
+		conn->lost = 0;
+		conn->events = EPOLLIN;
+		conn->in_len = 0;
+		conn->out_len = 0;
+		conn->out_sent = 0;
+		ev.events = conn->events;
+		ev.data.ptr = conn;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			conn->fd = -1;
+			continue;
+		}
+		loop->nr_free--;
+	}
+	if (loop->nr_free == 0) {
+		/* new clients wait in the backlog until a slot frees up somewhere */
+		server_listen(loop, 0);
+	}
+}
+
+/* the fields a subscription names, 0 if one of them is unknown */
+static uint32_t server_fields(char *list) {
+
+	uint32_t mask = 0;
+	char *name, *save;
+	int field;
+
+	for (name = strtok_r(list, ",", &save); name != NULL;
+			name = strtok_r(NULL, ",", &save)) {
+		if (strcmp(name, "all") == 0) {
+			mask |= ~0U >> (32 - SDK_NR_FIELDS);
+		} else if (strcmp(name, "dry") == 0) {
+			mask |= ((1U << SDK_NR_DRY_CONTACTS) - 1) << SDK_FIELD_DRY;
+		} else if ((field = sdk_table_lookup(name)) >= 0) {
+			mask |= 1U << field;
+		} else {
+			return 0;
+		}
+	}
+	return mask;
+}
+
+/* "quit": no answer, the session ends once the earlier ones are out */
+static int session_quit(struct server_conn *conn, struct server_args *args,
+		char *out, int size) {
+
+	conn->closing = 1;
+	return (-1);
+}
+
+/* "subscribe <fields> [heartbeat] [@n]": "ok", or empty for unknown fields */
+static int session_subscribe(struct server_conn *conn, struct server_args *args,
+		char *out, int size) {
+
+	uint32_t mask;
+
+	if (args->nr_args < 1) {
+		return 0;
+	}
+	mask = server_fields(args->arg[0]);
+	if (mask == 0) {
+		return 0;
+	}
+	if (!conn->subscribed) {
+		conn->subscribed = 1;
+		__sync_fetch_and_add(&m_subscribers, 1);
+	}
+	conn->sub_device = args->device;
+	conn->sub_mask = mask;
+	conn->heartbeat = args->nr_args > 1 ? atol(args->arg[1]) * 1000 : 0;
+	conn->next_heartbeat = server_now_ms() + conn->heartbeat;
+	return snprintf(out, size, "ok");
+}
+
+static int session_unsubscribe(struct server_conn *conn, struct server_args *args,
+		char *out, int size) {
+
+	server_unsubscribe(conn);
+	return snprintf(out, size, "ok");
+}
+
+/*
+ * Send pending output, answer and tail in one gathered write and keep what
+ * the socket did not take. sendmsg() is writev() that can be told not to
+ * raise SIGPIPE. Errors are left for the next flush to find.
+ */
+static void server_send(struct server_conn *conn, const char *answer, int len,
+		const char *tail, int tail_len) {
+
+	struct iovec iov[3];
+	struct msghdr msg;
+	int n, skip, i;
+
+	iov[0].iov_base = conn->out + conn->out_sent;
+	iov[0].iov_len = conn->out_len - conn->out_sent;
+	iov[1].iov_base = (void *) answer;
+	iov[1].iov_len = len;
+	iov[2].iov_base = (void *) tail;
+	iov[2].iov_len = tail_len;
+	memset(&msg, 0, sizeof (msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+	if (n < 0) {
+		n = 0;
+	} else if (n > 0) {
+		server_touch(conn);
+	}
+	for (i = 0; i < 3; i++) {
+		skip = n < iov[i].iov_len ? n : iov[i].iov_len;
+		n -= skip;
+		if (i == 0) {
+			conn->out_sent += skip;
+			continue;
+		}
+		/* the answer may have been rendered right there */
+		memmove(conn->out + conn->out_len, (char *) iov[i].iov_base + skip,
+				iov[i].iov_len - skip);
+		conn->out_len += iov[i].iov_len - skip;
+	}
+}
+
+/*
+ * Answer request, followed by an empty line in a session. The last
+ * request of a burst goes out at once, cached answers without a copy,
+ * earlier ones are collected for a single send.
+ */
+static void server_request(struct server_loop *loop, struct server_conn *conn,
+		const char *request, int last) {
+
+	char *out = conn->out + conn->out_len;
+	const char *answer;
+	const char *tail = "\n\n";
+	int len, tail_len, binary = 0;
+
+	if (!conn->session) {
+		len = server_answer(loop, conn, request, out, SERVER_OUT_SIZE, &answer, &binary);
+		server_send(conn, answer, len, NULL, 0);
+		conn->closing = 1;
+		return;
+	}
+	/* two bytes kept for the terminating newlines */
+	len = server_answer(loop, conn, request, out, SERVER_OUT_SIZE - 2, &answer, &binary);
+	if (len < 0) {
+		return;
+	}
+	/* a record may end in a newline byte, its tail must not depend on that */
+	tail_len = (binary || (len > 0 && answer[len - 1] != '\n')) ? 2 : 1;
+	if (conn->stream) {
+		/* the tail follows the last chunk */
+		conn->stream_last = len > 0 ? answer[len - 1] : '\0';
+		tail_len = 0;
 	}
+	if (last) {
+		server_send(conn, answer, len, tail, tail_len);
+		return;
+	}
+	if (answer != out) {
+		memcpy(out, answer, len);
+	}
+	memcpy(out + len, tail, tail_len);
+	conn->out_len += len + tail_len;
+}
+
+/*
+ * Render the next chunk of a streamed answer into the emptied output
+ * buffer, followed by the tail in a session once it is complete.
+ */
+static void server_stream(struct server_conn *conn) {
 
-	printf("New message received: %s\n", buffer);
+	struct server_args *args = &conn->stream_args;
+	struct sdk_state st;
+	int len;
 
-	if (strcmp(buffer, HW) == 0) {
-		bzero(buffer, BUFFER_SIZE);
-		sprintf(buffer, "%d", external_sdk_53.hw);
+	args->more = 0;
+	sdk_state_read(args->device, &st);
+	len = server_clamp(conn->stream->handler(&st, args, conn->out, SERVER_OUT_SIZE - 2),
+			SERVER_OUT_SIZE - 2);
+	if (len > 0) {
+		conn->stream_last = conn->out[len - 1];
 	}
-	if (strcmp(buffer, SW) == 0) {
-		bzero(buffer, BUFFER_SIZE);
-		sprintf(buffer, "%d", external_sdk_53.sw);
+	if (!args->more) {
+		conn->stream = NULL;
+		if (conn->session) {
+			memcpy(conn->out + len, "\n\n", 2);
+			len += conn->stream_last == '\n' ? 1 : 2;
+		}
 	}
-	if (strcmp(buffer, TEMP) == 0) {
-		bzero(buffer, BUFFER_SIZE);
-		sprintf(buffer, "%d", external_sdk_53.self_temp);
+	conn->out_len = len;
+}
+
+/* answer the complete lines in the read buffer while there is room */
+static void server_process(struct server_loop *loop, struct server_conn *conn) {
+
+	char *nl;
+	int used;
+
+	while (!conn->closing && !conn->stream && conn->out_len <= SERVER_PIPE_SIZE) {
+		nl = memchr(conn->in, '\n', conn->in_len);
+		if (nl == NULL) {
+			break;
+		}
+		*nl = '\0';
+		if (nl > conn->in && nl[-1] == '\r') {
+			nl[-1] = '\0';
+		}
+		used = nl + 1 - conn->in;
+		server_request(loop, conn, conn->in,
+				memchr(nl + 1, '\n', conn->in_len - used) == NULL);
+		memmove(conn->in, nl + 1, conn->in_len - used);
+		conn->in_len -= used;
 	}
-	if (strcmp(buffer, RELAY) == 0) {
-		bzero(buffer, BUFFER_SIZE);
-		sprintf(buffer, "%d", external_sdk_53.relay);
+}
+
+/* answer, send and decide what to wait for next, until the socket pushes back */
+static void server_drive(struct server_loop *loop, struct server_conn *conn) {
+
+	int done;
+
+	while (1) {
+		server_process(loop, conn);
+		done = server_flush(conn);
+		if (done < 0) {
+			server_close(loop, conn);
+			return;
+		}
+		if (done == 0) {
+			/* the client reads slower than it asks, stop reading meanwhile */
+			server_watch(loop, conn, EPOLLOUT);
+			return;
+		}
+		conn->out_len = 0;
+		conn->out_sent = 0;
+		if (conn->stream) {
+			server_stream(conn);
+			continue;
+		}
+		if (conn->closing) {
+			server_close(loop, conn);
+			return;
+		}
+		if (memchr(conn->in, '\n', conn->in_len) == NULL) {
+			server_watch(loop, conn, EPOLLIN);
+			return;
+		}
+	}
+}
+
+static void server_read(struct server_loop *loop, struct server_conn *conn) {
+
+	int n;
+
+	n = read(conn->fd, conn->in + conn->in_len, BUFFER_SIZE - 1 - conn->in_len);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		server_close(loop, conn);
+		return;
+	}
+	conn->in_len += n;
+	if (!conn->session && conn->in_len == n) {
+		if (memchr(conn->in, '\n', n) != NULL) {
+			conn->session = 1;
+		} else {
+			/* legacy client: the first read is the request */
+			conn->in[n] = '\0';
+			server_request(loop, conn, conn->in, 1);
+			conn->in_len = 0;
+		}
+	} else if (conn->in_len == BUFFER_SIZE - 1
+			&& memchr(conn->in, '\n', conn->in_len) == NULL) {
+		/* no request is that long */
+		server_close(loop, conn);
+		return;
 	}
-	if (strcmp(buffer, OPTICAL) == 0) {
-			bzero(buffer, BUFFER_SIZE);
+	server_touch(conn);
+	server_drive(loop, conn);
+}
+
+/* change listener, runs on the poller thread */
+static void server_feed(void *arg, const struct sdk_delta *delta) {
+
+	uint64_t one = 1;
+	int i;
+
+	if (m_subscribers == 0) {
+		return;
+	}
+	m_feed[m_feed_head & SERVER_FEED_MASK] = *delta;
+	/* the slot must be complete before the loops can see it */
+	__sync_synchronize();
+	m_feed_head++;
+	for (i = 0; i < m_nr_loops; i++) {
+		if (write(m_loops[i].feed_fd, &one, sizeof (one)) < 0) {
+			/* the counter is only full if the loop is stuck anyway */
+		}
+	}
+}
 
-			int i = 0;
-			for (i; i<20; i++) {
-				buffer[i] = external_sdk_53.optical_relay[i];
+/* room for one more push record, counting it as lost if there is none */
+static int server_push_room(struct server_conn *conn) {
+
+	/* nothing is pushed into the middle of an answer */
+	if (conn->stream || conn->out_len + 2 * SERVER_PUSH_LINE > sizeof (conn->out)) {
+		conn->lost++;
+		return 0;
+	}
+	if (conn->lost > 0) {
+		conn->out_len += snprintf(conn->out + conn->out_len, SERVER_PUSH_LINE,
+				"* lost %lu\n", conn->lost);
+		conn->lost = 0;
+	}
+	return 1;
+}
+
+static void server_push(struct server_loop *loop, const struct sdk_delta *delta) {
+
+	struct server_conn *conn;
+	const struct sdk_change *c;
+	char name[SDK_NAME_SIZE];
+	int i, j;
+
+	for (i = 0; i < loop->nr_conns; i++) {
+		conn = &loop->conn[i];
+		if (conn->fd < 0 || !conn->subscribed || conn->sub_device != delta->device
+				|| (conn->sub_mask & delta->mask) == 0) {
+			continue;
+		}
+		for (j = 0; j < delta->nr_changes; j++) {
+			c = &delta->change[j];
+			if (!(conn->sub_mask & (1U << c->field)) || !server_push_room(conn)) {
+				continue;
 			}
+			sdk_table_name(c->field, name, sizeof (name));
+			conn->out_len += snprintf(conn->out + conn->out_len, SERVER_PUSH_LINE,
+					"* %s %lu %ld.%09ld\n", name, (unsigned long) c->new_value,
+					(long) delta->time.tv_sec, delta->time.tv_nsec);
+		}
+		conn->next_heartbeat = server_now_ms() + conn->heartbeat;
+	}
+}
+
+/* a subscriber lost count deltas the loop was too slow to copy */
+static void server_push_lost(struct server_loop *loop, unsigned long count) {
 
+	int i;
+
+	for (i = 0; i < loop->nr_conns; i++) {
+		if (loop->conn[i].fd >= 0 && loop->conn[i].subscribed) {
+			loop->conn[i].lost += count;
 		}
-	if (strcmp(buffer, DRY) == 0) {
-		bzero(buffer, BUFFER_SIZE);
+	}
+}
+
+/* close what outlived its deadline, returns ms until the next one or -1 for none */
+static int server_expire(struct server_loop *loop) {
 
-		int i = 0;
-		for (i; i<20; i++) {
-			buffer[i] = external_sdk_53.dry_contact[i];
+	struct server_conn *conn;
+	long now = server_now_ms(), wait = -1;
+	int i;
+
+	for (i = 0; i < loop->nr_conns; i++) {
+		conn = &loop->conn[i];
+		if (conn->fd < 0 || conn->deadline == 0) {
+			continue;
+		}
+		if (now - conn->deadline >= 0) {
+			server_close(loop, conn);
+			continue;
 		}
+		if (wait < 0 || conn->deadline - now < wait) {
+			wait = conn->deadline - now;
+		}
+	}
+	return wait;
+}
+
+/* push every delta the poller fed since the last call */
+static void server_feed_read(struct server_loop *loop) {
+
+	struct sdk_delta delta;
+	unsigned long head, seq;
+	uint64_t count;
 
+	if (read(loop->feed_fd, &count, sizeof (count)) < 0) {
+		/* woken for nothing, the feed is read below anyway */
 	}
+	head = m_feed_head;
+	__sync_synchronize();
+	seq = loop->feed_next;
+	if (head - seq > SERVER_FEED_SIZE) {
+		server_push_lost(loop, head - SERVER_FEED_SIZE - seq);
+		seq = head - SERVER_FEED_SIZE;
+	}
+	for (; seq != head; seq++) {
+		delta = m_feed[seq & SERVER_FEED_MASK];
+		/* the poller may have lapped us while copying */
+		__sync_synchronize();
+		if (m_feed_head - seq >= SERVER_FEED_SIZE) {
+			server_push_lost(loop, 1);
+			continue;
+		}
+		server_push(loop, &delta);
+	}
+	loop->feed_next = seq;
+}
 
-	rw = write(sockfd, buffer, strlen(buffer));
+/* heartbeats that are due, returns ms until the next one or -1 for none */
+static int server_heartbeat(struct server_loop *loop) {
 
-	if (rw < 0) {
-		perror("Error writing to socket, exiting thread");
-		pthread_exit(0);
+	struct server_conn *conn;
+	long now = server_now_ms(), wait = -1;
+	int i;
+
+	for (i = 0; i < loop->nr_conns; i++) {
+		conn = &loop->conn[i];
+		if (conn->fd < 0 || !conn->subscribed || conn->heartbeat <= 0) {
+			continue;
+		}
+		if (now - conn->next_heartbeat >= 0) {
+			if (server_push_room(conn)) {
+				conn->out_len += snprintf(conn->out + conn->out_len, SERVER_PUSH_LINE,
+						"* heartbeat %lu\n",
+						sdk_state_generation(conn->sub_device));
+			}
+			conn->next_heartbeat = now + conn->heartbeat;
+		}
+		if (wait < 0 || conn->next_heartbeat - now < wait) {
+			wait = conn->next_heartbeat - now;
+		}
 	}
+	return wait;
+}
 
-	pthread_mutex_lock(&lock);
+/* send what pushes and heartbeats left in the subscribers' buffers */
+static void server_push_flush(struct server_loop *loop) {
 
-	pthread_mutex_unlock(&lock);
-	close(sockfd);
-	pthread_exit(0);
+	struct server_conn *conn;
+	int i;
 
+	for (i = 0; i < loop->nr_conns; i++) {
+		conn = &loop->conn[i];
+		if (conn->fd >= 0 && conn->subscribed && conn->out_sent < conn->out_len) {
+			server_drive(loop, conn);
+		}
+	}
 }
 
-int server_run() {
+static void *server_loop_run(void *arg) {
 
-	int serv_sockfd, new_sockfd;
+	struct server_loop *loop = (struct server_loop *) arg;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	struct server_conn *conn;
+	int nfds, n, timeout, wait;
+
+	while (1) {
+		timeout = server_heartbeat(loop);
+		wait = server_expire(loop);
+		if (wait >= 0 && (timeout < 0 || wait < timeout)) {
+			timeout = wait;
+		}
+		server_push_flush(loop);
+		nfds = epoll_wait(loop->epfd, events, SERVER_MAX_EVENTS, timeout);
+		if (nfds < 0 && errno != EINTR) {
+			write_log("Crash epoll for TCP server");
+			break;
+		}
+		for (n = 0; n < nfds; n++) {
+			conn = (struct server_conn *) events[n].data.ptr;
+			if (conn == NULL) {
+				server_accept(loop);
+			} else if (events[n].data.ptr == &loop->feed_fd) {
+				server_feed_read(loop);
+			} else if (events[n].events & (EPOLLERR | EPOLLHUP)) {
+				server_close(loop, conn);
+			} else if (events[n].events & EPOLLOUT) {
+				server_drive(loop, conn);
+			} else if (events[n].events & EPOLLIN) {
+				server_read(loop, conn);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Set up port 32001 for nr_threads event loops sharing the listening socket
+ * and splitting a pool of max_conns connections. Registers the change listener, so it
+ * has to run before the poller thread starts.
+ */
+int server_init(int nr_threads, int max_conns) {
+
+	struct epoll_event ev;
 	struct addrinfo flags;
 	struct addrinfo *host_info;
-	socklen_t addr_size;
-
-	struct sockaddr_storage client;
+	struct server_loop *loop;
+	int serv_sockfd, on = 1;
+	int i, per_loop, first;
 
-	pthread_attr_t attr;
-	int i;
+	if (nr_threads < 1) {
+		nr_threads = 1;
+	}
+	if (nr_threads > SERVER_MAX_THREADS) {
+		nr_threads = SERVER_MAX_THREADS;
+	}
+	if (max_conns < nr_threads) {
+		max_conns = nr_threads;
+	}
 
 	memset(&flags, 0, sizeof(flags));
 	flags.ai_family = AF_INET;
@@ -130,6 +1130,9 @@ int server_run() {
 		exit(-1);
 	}
 
+	/* a restarted daemon must not wait for the old connections' TIME_WAIT */
+	setsockopt(serv_sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
 	if (bind(serv_sockfd, host_info->ai_addr, host_info->ai_addrlen) < 0) {
 		perror("Error on binding");
 		exit(-1);
@@ -137,32 +1140,74 @@ int server_run() {
 
 	freeaddrinfo(host_info);
 
-	pthread_attr_init(&attr);
-	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	listen(serv_sockfd, QUEUE_SIZE);
-
-	addr_size = sizeof(client);
-	i = 0;
+	fcntl(serv_sockfd, F_SETFL, fcntl(serv_sockfd, F_GETFL) | O_NONBLOCK);
+	if (listen(serv_sockfd, SOMAXCONN) < 0) {
+		perror("Error on listen");
+		exit(-1);
+	}
 
-	while (1) {
-		if (i == NTHREADS) {
-			i = 0;
+	server_commands_init();
+	m_conns = calloc(max_conns, sizeof (struct server_conn));
+	if (m_conns == NULL) {
+		perror("Error allocating connections");
+		exit(-1);
+	}
+	for (i = 0; i < max_conns; i++) {
+		m_conns[i].fd = -1;
+	}
+	/* the first loops take one more each if the pool does not split evenly */
+	per_loop = max_conns / nr_threads;
+	for (i = 0, first = 0; i < nr_threads; i++) {
+		loop = &m_loops[i];
+		loop->listen_fd = serv_sockfd;
+		loop->conn = &m_conns[first];
+		loop->nr_conns = per_loop + (i < max_conns % nr_threads);
+		loop->nr_free = loop->nr_conns;
+		loop->listening = 1;
+		first += loop->nr_conns;
+		loop->cache = calloc(sdk_device_list_length * SERVER_NR_COMMANDS,
+				sizeof (struct server_cache));
+		if (loop->cache == NULL) {
+			perror("Error allocating answer cache");
+			exit(-1);
 		}
-
-		new_sockfd = accept(serv_sockfd, (struct sockaddr *) &client,
-				&addr_size);
-
-		if (new_sockfd < 0) {
-			perror("Error on accept");
+		loop->epfd = epoll_create(SERVER_MAX_EVENTS);
+		if (loop->epfd < 0) {
+			perror("Error on epoll");
 			exit(-1);
 		}
+		/* every loop with a free slot watches the listener, whoever accepts first wins */
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, serv_sockfd, &ev) < 0) {
+			perror("Error on epoll");
+			exit(-1);
+		}
+		loop->feed_fd = eventfd(0, EFD_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = &loop->feed_fd;
+		if (loop->feed_fd < 0
+				|| epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->feed_fd, &ev) < 0) {
+			perror("Error on eventfd");
+			exit(-1);
+		}
+	}
+	m_nr_loops = nr_threads;
+	return sdk_add_listener(server_feed, NULL);
+}
 
-		pthread_create(&threadid[i++], &attr, &threadworker,
-				(void *) new_sockfd);
-		sleep(0);
+/* run the loops, the calling thread runs the first one and does not return */
+int server_run(void) {
+
+	pthread_t thread;
+	int i;
+
+	for (i = 1; i < m_nr_loops; i++) {
+		if (pthread_create(&thread, NULL, server_loop_run, &m_loops[i]) != 0) {
+			write_log("Could not start TCP server thread");
+		}
 	}
+	server_loop_run(&m_loops[0]);
 
 	return 0;
 }
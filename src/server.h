@@ -1,7 +1,12 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 
+/* event loops the TCP server may be split across */
+#define SERVER_MAX_THREADS	8
+/* connections served at once unless -m says otherwise */
+#define SERVER_DEFAULT_CONNS	256
 
-int server_run();
+int server_init(int, int);
+int server_run(void);
 
 #endif /*SERVER_H_*/
@@ -40,8 +40,9 @@
     
 #include "mini_snmpd.h"
 #include "parser_sdk.h"
+#include "sdk_edge.h"
+#include "sdk_state.h"
 
-struct sdk_param external_sdk_53;
 
 int read_file(const char *filename, char *buffer, size_t size)
 {
@@ -296,37 +297,25 @@ void get_demoinfo(demoinfo_t *demoinfo)
 
 void get_sdkinfo(sdkinfo_t *sdkinfo)
 {
-   sdkinfo->sdk_temp = external_sdk_53.self_temp;
-   sdkinfo->sdk_hw = external_sdk_53.hw;
-   sdkinfo->sdk_sw = external_sdk_53.sw;
-   sdkinfo->sdk_relay = external_sdk_53.relay;
-   sdkinfo->optical_relay_1  = external_sdk_53.optical_relay[0] ;
-   sdkinfo->optical_relay_2  = external_sdk_53.optical_relay[1];
-   sdkinfo->optical_relay_3  = external_sdk_53.optical_relay[2];
-   sdkinfo->optical_relay_4  = external_sdk_53.optical_relay[3];
-   sdkinfo->dry_contact_1 = external_sdk_53.dry_contact[0]- '0';
-   sdkinfo->dry_contact_2 = external_sdk_53.dry_contact[1]- '0';
-   sdkinfo->dry_contact_3 = external_sdk_53.dry_contact[2]- '0';
-   sdkinfo->dry_contact_4 = external_sdk_53.dry_contact[3]- '0';
-   sdkinfo->dry_contact_5 = external_sdk_53.dry_contact[4]- '0';
-   sdkinfo->dry_contact_6 = external_sdk_53.dry_contact[5]- '0';
-   sdkinfo->dry_contact_7 = external_sdk_53.dry_contact[6]- '0';
-   sdkinfo->dry_contact_8 = external_sdk_53.dry_contact[7]- '0';
-   sdkinfo->dry_contact_9 = external_sdk_53.dry_contact[8]- '0';
-   sdkinfo->dry_contact_10 = external_sdk_53.dry_contact[9]- '0';
-   sdkinfo->dry_contact_11 = external_sdk_53.dry_contact[10]- '0';
-   sdkinfo->dry_contact_12 = external_sdk_53.dry_contact[11]- '0';
-   sdkinfo->dry_contact_13 = external_sdk_53.dry_contact[12]- '0';
-   sdkinfo->dry_contact_14 = external_sdk_53.dry_contact[13]- '0';
-   sdkinfo->dry_contact_15 = external_sdk_53.dry_contact[14]- '0';
-   sdkinfo->dry_contact_16 = external_sdk_53.dry_contact[15]- '0';
-   sdkinfo->dry_contact_17 = external_sdk_53.dry_contact[16]- '0';
-   sdkinfo->dry_contact_18 = external_sdk_53.dry_contact[17]- '0';
-   sdkinfo->dry_contact_19 = external_sdk_53.dry_contact[18]- '0';
-   sdkinfo->dry_contact_20 = external_sdk_53.dry_contact[19]- '0';
-  
-
-
+   struct sdk_state st;
+   int i;
+
+   sdk_state_read(0, &st);
+   sdkinfo->generation = st.generation;
+   for (i = 0; i < SDK_NR_DRY_CONTACTS; i++) {
+      sdkinfo->dry_contact[i] = sdk_state_dry(&st, i);
+   }
+   sdkinfo->sdk_temp = sdk_state_temp(&st);
+   sdkinfo->sdk_hw = sdk_state_hw(&st);
+   sdkinfo->sdk_sw = sdk_state_sw(&st);
+   sdkinfo->sdk_relay = sdk_state_relay(&st);
+   for (i = 0; i < SDK_NR_OPTICAL_RELAYS; i++) {
+      sdkinfo->optical_relay[i] = sdk_state_optical(&st, i);
+   }
+   for (i = 0; i < SDK_NR_DRY_CONTACTS; i++) {
+      sdkinfo->edge_count[i] = sdk_edge_count(0, i);
+   }
+   sdkinfo->stale = sdk_state_stale(&st);
 }
 
 